@@ -12,6 +12,9 @@
 #ifdef DHT11_PORT
 #include "../modules/dht11.h"
 #endif
+#ifdef I2C_STATS_SIZE
+#include "../modules/i2c.h"
+#endif
 #ifdef LCD_ADDRESS
 #include "../modules/lcd.h"
 #endif
@@ -518,6 +521,36 @@ void SCOM_messageSentHandler(SCOM_Channel_t channel) {
                 } else  SCOM_queue[channel].index = (SCOM_queue[channel].index + 1) % SCOM_QUEUE_SIZE;
                 break;
 #endif
+#ifdef I2C_STATS_SIZE
+            case MESSAGE_KIND_I2C_STATS:
+                param1 = SCOM_queue[channel].param1[SCOM_queue[channel].index]; // Slot
+                param2 = 0; // Number of used slots
+                while (param2 < I2C_STATS_SIZE && I2C_stats(param2)) param2++;
+                SCOM_addDataByte(channel, 0, MESSAGE_KIND_I2C_STATS); // Kind
+                SCOM_addDataByte(channel, 1, param1);
+                SCOM_addDataByte(channel, 2, param2);
+                if (param1 < param2) {
+                    I2C_Stats_t *stats = I2C_stats(param1);
+                    SCOM_addDataByte(channel, 3, stats->address);
+                    SCOM_addDataByte2(channel, 4, stats->transactions);
+                    SCOM_addDataByte2(channel, 6, stats->bytes);
+                    SCOM_addDataByte2(channel, 8, stats->retries);
+                    SCOM_addDataByte2(channel, 10, stats->nacks);
+                    SCOM_addDataByte2(channel, 12, stats->failures);
+#ifdef I2C_STATS_TIMER
+                    for (uint8_t i = 0; i < I2C_STATS_BUCKETS; i++) {
+                        SCOM_addDataByte2(channel, 14 + i * 2, stats->latency[i]);
+                    }
+#endif
+                }
+                if (SCOM_commitData(channel, param1 < param2 ? SCOM_I2C_STATS_LENGTH : 3,
+                        SCOM_MAX_SEND_RETRIES)) {
+                    if (param1 + 1 < param2) { // Continue with the next slot
+                        SCOM_queue[channel].param1[SCOM_queue[channel].index]++;
+                    } else  SCOM_queue[channel].index = (SCOM_queue[channel].index + 1) % SCOM_QUEUE_SIZE;
+                }
+                break;
+#endif
 #ifdef RGB_ENABLED
             case MESSAGE_KIND_RGB:
                 param1 = SCOM_queue[channel].param1[SCOM_queue[channel].index]
@@ -847,6 +880,15 @@ void SCOM_dataHandler(SCOM_Channel_t channel, uint8_t length, uint8_t *data) {
             }
             break;
 #endif
+#ifdef I2C_STATS_SIZE
+        case MESSAGE_KIND_I2C_STATS:
+            if (length == 2) { // Request statistics of all slave addresses
+                SCOM_enqueue(channel, MESSAGE_KIND_I2C_STATS, 0x00, 0x00);
+            } else if (length == 3 && *(data + 2) == 0xFF) { // Clear
+                I2C_statsClear();
+            }
+            break;
+#endif
 #ifdef RGB_ENABLED
         case MESSAGE_KIND_RGB:
             if (length == 2) { // Request strip count.
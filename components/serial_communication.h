@@ -52,6 +52,17 @@ extern "C" {
 #define SCOM_PARAM_LCD_BACKLIGH 0x7E
 #endif
 
+#ifdef I2C_STATS_SIZE
+#ifdef I2C_STATS_TIMER
+#define SCOM_I2C_STATS_LENGTH 22 // KIND + IDX + CNT + ADDR + 5 counters + 4 buckets
+#else
+#define SCOM_I2C_STATS_LENGTH 14 // KIND + IDX + CNT + ADDR + 5 counters
+#endif
+#if SCOM_MAX_PACKET_SIZE < SCOM_I2C_STATS_LENGTH + 1
+#error "SCOM: SCOM_MAX_PACKET_SIZE too small for I2C statistics!"
+#endif
+#endif
+
 #if defined USB_ENABLED && defined BM78_ENABLED
 #define SCOM_CHANNEL_COUNT 2
 #elif defined USB_ENABLED || defined BM78_ENABLED
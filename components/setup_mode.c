@@ -372,7 +372,7 @@ void SUM_showMenu(uint8_t page) {
             LCD_setString("-) Memory Viewer    ", 1, false);
 #endif
 #ifdef SM_MEM_ADDRESS
-            if (I2C_readRegister16(SM_MEM_ADDRESS, SM_MEM_START) == SM_STATUS_ENABLED) {
+            if (I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(SM_MEM_START)) == SM_STATUS_ENABLED) {
                 LCD_setString("3) Lock SM       [ ]", 2, false);
             } else {
                 LCD_setString("3) Unlock SM     [X]", 2, false);
@@ -566,9 +566,11 @@ void SUM_executeMenu(uint8_t key) {
                     LCD_clearCache();
 #ifdef MEM_SUM_LCD_CACHE_START
                     for (SUM_i = 0; SUM_i < LCD_ROWS; SUM_i++) {
+                        uint8_t row[LCD_COLS];
+                        SUM_mem.reg = MEM_SUM_LCD_CACHE_START + (SUM_i * LCD_COLS);
+                        I2C_readBlock16(MEM_ADDRESS, SUM_mem.reg, LCD_COLS, row);
                         for (SUM_j = 0; SUM_j < LCD_COLS; SUM_j++) {
-                            SUM_mem.reg = MEM_SUM_LCD_CACHE_START + (SUM_i * LCD_COLS) + SUM_j;
-                            LCD_setCache(SUM_i, SUM_j, I2C_readRegister16(MEM_ADDRESS, SUM_mem.reg));
+                            LCD_setCache(SUM_i, SUM_j, row[SUM_j]);
                         }
                     }
 #else
@@ -1066,8 +1068,8 @@ void SUM_executeMenu(uint8_t key) {
 #endif
 #ifdef SM_MEM_ADDRESS
                 case '3': // Lock/Unlock State Machine
-                    byte = I2C_readRegister16(SM_MEM_ADDRESS, SM_MEM_START);
-                    I2C_writeRegister16(SM_MEM_ADDRESS, SM_MEM_START,
+                    byte = I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(SM_MEM_START));
+                    I2C_writeRegister16(SM_MEM_ADDRESS, SM_ADDRESS(SM_MEM_START),
                             byte == SM_STATUS_DISABLED 
                             ? SM_STATUS_ENABLED : SM_STATUS_DISABLED);
                     SM_init();
@@ -4,6 +4,7 @@
  */
 #include "state_machine_interaction.h"
 #include "serial_communication.h"
+#include "../lib/common.h"
 #include "../lib/types.h"
 #include "../modules/bm78.h"
 #ifdef LCD_ADDRESS
@@ -19,6 +20,15 @@
 #endif
 #endif
 #include "../modules/state_machine.h"
+#if defined MCP23017_ENABLED && defined SM_MEM_ADDRESS
+#if defined SM_IN4_ADDRESS && SM_STATE_SIZE < 9
+#error "SMI: SM_IN4_ADDRESS needs SM_STATE_SIZE of at least 9"
+#elif defined SM_IN3_ADDRESS && SM_STATE_SIZE < 7
+#error "SMI: SM_IN3_ADDRESS needs SM_STATE_SIZE of at least 7"
+#elif defined SM_IN1_ADDRESS && defined SM_IN2_ADDRESS && SM_STATE_SIZE < 5
+#error "SMI: SM_IN1_ADDRESS and SM_IN2_ADDRESS need SM_STATE_SIZE of at least 5"
+#endif
+#endif
 #ifdef WS281x_BUFFER
 #include "../modules/ws281x.h"
 #endif
@@ -35,6 +45,22 @@ bool shouldTrigger = false;
 
 Procedure_t SMI_BluetoothTrigger;
 
+#if defined MCP23017_ENABLED && defined SM_OUT_ADDRESS
+struct {
+    uint8_t olat; // Shadow of the output latch.
+    bool loaded;  // Whether the shadow was read since the last flush.
+    bool dirty;   // Whether the shadow differs from the output latch.
+} SMI_out = { 0x00, false, false };
+
+void SMI_flushOutputs(void) {
+    if (SMI_out.dirty) {
+        MCP23017_write(SM_OUT_ADDRESS, MCP23017_OLATA + SM_OUT_PORT, SMI_out.olat);
+    }
+    SMI_out.dirty = false;
+    SMI_out.loaded = false; // Re-read on next change, the outputs may be set elsewhere
+}
+#endif
+
 void SMI_enterState(uint8_t stateId) {
     if (!SM_enter(stateId)) {
 #ifdef LCD_ADDRESS
@@ -46,19 +72,69 @@ void SMI_enterState(uint8_t stateId) {
     }
 }
 
+#if defined MCP23017_ENABLED && defined SM_IN1_ADDRESS && defined SM_IN2_ADDRESS && defined SM_CHECK_IDLE_INTERVAL
+/**
+ * Enables interrupt-on-change on all pins of the input MCP23017s. The INTA and
+ * INTB pins are mirrored and configured as open-drain so both chips can share
+ * one interrupt line.
+ */
+void SMI_initInputs(void) {
+    uint8_t addresses[] = { SM_IN1_ADDRESS, SM_IN2_ADDRESS
+#ifdef SM_IN3_ADDRESS
+            , SM_IN3_ADDRESS
+#endif
+#ifdef SM_IN4_ADDRESS
+            , SM_IN4_ADDRESS
+#endif
+    };
+    for (uint8_t i = 0; i < sizeof(addresses); i++) {
+        MCP23017_write(addresses[i], MCP23017_IOCON, 0b01000100); // MIRROR, ODR
+        MCP23017_write(addresses[i], MCP23017_INTCONA, 0b00000000); // Interrupt-on-change
+        MCP23017_write(addresses[i], MCP23017_INTCONB, 0b00000000); // Interrupt-on-change
+        MCP23017_write(addresses[i], MCP23017_GPINTENA, 0b11111111); // Enable interrupt on GPIOA
+        MCP23017_write(addresses[i], MCP23017_GPINTENB, 0b11111111); // Enable interrupt on GPIOB
+        MCP23017_read(addresses[i], MCP23017_GPIOA); // Read to clear interrupt
+        MCP23017_read(addresses[i], MCP23017_GPIOB); // Read to clear interrupt
+    }
+}
+
+void SMI_inputInterruptHandler(void) {
+    SM_trigger();
+}
+#endif
+
 void SMI_start(void) {
+#if defined MCP23017_ENABLED && defined SM_OUT_ADDRESS
+    SM_setCheckedHandler(SMI_flushOutputs);
+#endif
     SM_reset();
     SM_init();
+#if defined MCP23017_ENABLED && defined SM_IN1_ADDRESS && defined SM_IN2_ADDRESS && defined SM_CHECK_IDLE_INTERVAL
+    SMI_initInputs();
+#endif
+#ifdef SM_PERSIST_INTERVAL
+    if (SM_resume()) return; // Continue where it was before the reset
+#endif
     SMI_enterState(0);
 }
 
 #if defined MCP23017_ENABLED && defined SM_IN1_ADDRESS && defined SM_IN2_ADDRESS
 void SMI_stateGetter(uint8_t *state) {
+    // Reading GPIOx also clears pending interrupt-on-change
     *(state + 0) = MCP23017_read(SM_IN1_ADDRESS, MCP23017_GPIOA);
     *(state + 1) = MCP23017_read(SM_IN1_ADDRESS, MCP23017_GPIOB);
     *(state + 2) = MCP23017_read(SM_IN2_ADDRESS, MCP23017_GPIOA);
     *(state + 3) = MCP23017_read(SM_IN2_ADDRESS, MCP23017_GPIOB);
     *(state + 4) = 0;
+    for (uint8_t i = 5; i < SM_STATE_SIZE; i++) *(state + i) = 0;
+#ifdef SM_IN3_ADDRESS
+    *(state + 5) = MCP23017_read(SM_IN3_ADDRESS, MCP23017_GPIOA);
+    *(state + 6) = MCP23017_read(SM_IN3_ADDRESS, MCP23017_GPIOB);
+#endif
+#ifdef SM_IN4_ADDRESS
+    *(state + 7) = MCP23017_read(SM_IN4_ADDRESS, MCP23017_GPIOA);
+    *(state + 8) = MCP23017_read(SM_IN4_ADDRESS, MCP23017_GPIOB);
+#endif
 #ifdef BM78_ENABLED
     switch(BM78.status) {
         case BM78_STATUS_STANDBY_MODE:
@@ -79,14 +155,17 @@ void SMI_stateGetter(uint8_t *state) {
 void SMI_actionHandler(uint8_t device, uint8_t length, uint8_t *value) {
 #if defined MCP23017_ENABLED && defined SM_OUT_ADDRESS
     if (device >= SM_DEVICE_MCP23017_OUT_START && device <= SM_DEVICE_MCP23017_OUT_END) {
-        if (length >= 1) {
-            uint8_t byte = MCP23017_read(SM_OUT_ADDRESS, MCP23017_GPIOA + SM_OUT_PORT);
+        if (length >= 1) { // Buffered until SMI_flushOutputs
+            if (!SMI_out.loaded) {
+                SMI_out.olat = MCP23017_read(SM_OUT_ADDRESS, MCP23017_GPIOA + SM_OUT_PORT);
+                SMI_out.loaded = true;
+            }
             if (*value) {
-                byte |= 0x01 << (device - SM_DEVICE_MCP23017_OUT_START);
+                SMI_out.olat |= 0x01 << (device - SM_DEVICE_MCP23017_OUT_START);
             } else {
-                byte &= ~(0x01 << (device - SM_DEVICE_MCP23017_OUT_START));
+                SMI_out.olat &= ~(0x01 << (device - SM_DEVICE_MCP23017_OUT_START));
             }
-            MCP23017_write(SM_OUT_ADDRESS, MCP23017_OLATA + SM_OUT_PORT, byte);
+            SMI_out.dirty = true;
             //SCOM_sendMCP23017(SCOM_CHANNEL_BT, SM_OUT_ADDRESS);
         }
     } else
@@ -111,7 +190,7 @@ void SMI_actionHandler(uint8_t device, uint8_t length, uint8_t *value) {
             SMI_lcd.content[i] = (ch == '\n' || (ch >= 0x20 && ch <= 0x7E))
                     ? ch : ' ';
         }
-        SMI_lcd.content[length] = '\0';
+        SMI_lcd.content[min(length, SM_VALUE_MAX_SIZE)] = '\0';
         SMI_lcd.available = true;
     } else if (device == SM_DEVICE_LCD_BACKLIGHT) {
         LCD_setBacklight(*value & 0x01);
@@ -137,6 +216,9 @@ void SMI_actionHandler(uint8_t device, uint8_t length, uint8_t *value) {
 }
 
 void SMI_evaluatedHandler(void) {
+#if defined MCP23017_ENABLED && defined SM_OUT_ADDRESS
+    SMI_flushOutputs();
+#endif
     SCOM_sendMCP23017(SCOM_CHANNEL_BT, SCOM_PARAM_ALL);
     SCOM_sendWS281xLED(SCOM_CHANNEL_BT, SCOM_PARAM_ALL);
     if (SMI_lcd.available) {
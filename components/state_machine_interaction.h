@@ -30,6 +30,24 @@ void SMI_start(void);
 void SMI_stateGetter(uint8_t *state);
 #endif
 
+#if defined MCP23017_ENABLED && defined SM_IN1_ADDRESS && defined SM_IN2_ADDRESS && defined SM_CHECK_IDLE_INTERVAL
+/**
+ * Input change interrupt handler. Should be called from the interrupt service
+ * routine of the pin the input MCP23017s' INTA/INTB outputs are connected to
+ * (active-low, open-drain, mirrored).
+ */
+void SMI_inputInterruptHandler(void);
+#endif
+
+#if defined MCP23017_ENABLED && defined SM_OUT_ADDRESS
+/**
+ * Writes the MCP23017 outputs changed by actions since the last flush with a
+ * single write. Registered as the state machine's checked handler by
+ * SMI_start, so the outputs change once per check and glitch-free.
+ */
+void SMI_flushOutputs(void);
+#endif
+
 /**
  * State machine action handler implementation. 
  * 
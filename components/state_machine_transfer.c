@@ -16,6 +16,207 @@
 Procedure_t uploadStartCallback = NULL;
 Procedure_t uploadFinishedCallback = NULL;
 
+struct {
+    SM_Crc_t crc; // CRC-16 of the uploaded bytes.
+    bool valid;   // Whether all bytes were received in order.
+#ifdef SM_SLOTS
+    uint8_t slot; // Slot the image is uploaded to.
+#endif
+} SMT_upload = { {0}, false };
+
+struct {
+    uint16_t start;  // Memory address of the digested image.
+    uint16_t length; // Length of the digested image.
+    uint16_t block;  // Next block to digest.
+    uint8_t size;    // Block size.
+} SMT_digest = { 0, 0, 0, SMT_DIGEST_BLOCK };
+
+#ifdef SMT_DIGEST_CACHE_SIZE
+struct {
+    uint16_t crc[SMT_DIGEST_CACHE_SIZE]; // Digests of the stored image.
+    uint8_t count;                       // Number of cached digests.
+    uint8_t size;                        // Block size of cached digests.
+} SMT_digestCache = { {0}, 0, 0 };
+#endif
+
+#ifdef SM_SLOTS
+#define SMT_INACTIVE_SLOT (SM_slot == SM_SLOT_B ? SM_SLOT_A : SM_SLOT_B)
+#define SMT_ADDRESS(address) SM_SLOT_ADDRESS(SMT_upload.slot, address)
+#else
+#define SMT_ADDRESS(address) (address)
+#endif
+
+struct {
+    SM_Crc_t crc;  // Streaming scan.
+    uint8_t stage; // 0x00 = idle, 0x01 = scanning, 0x02 = finished
+} SMT_scan = { {0}, 0x00 };
+
+/**
+ * Writes a block to the memory using page writes and reads it back until it
+ * matches. Bytes already stored are not rewritten.
+ * 
+ * @param reg Starting register.
+ * @param length Number of bytes to write (max. SMT_BLOCK_SIZE).
+ * @param data Data to write.
+ */
+void SMT_writeBlock(uint16_t reg, uint8_t length, uint8_t *data) {
+    uint8_t read[SMT_BLOCK_SIZE];
+    uint8_t i = 0;
+    I2C_readBlock16(SM_MEM_ADDRESS, reg, length, read);
+    while (i < length) {
+        if (read[i] != *(data + i)) { // Write cycle finished by ACK polling
+            I2C_writePage16(SM_MEM_ADDRESS, reg, length, data);
+            I2C_readBlock16(SM_MEM_ADDRESS, reg, length, read);
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+}
+
+/**
+ * Writes a byte to the memory and reads it back until it matches.
+ * 
+ * @param reg Register.
+ * @param byte Byte to write.
+ */
+void SMT_write(uint16_t reg, uint8_t byte) {
+    SMT_writeBlock(reg, 1, &byte);
+}
+
+/**
+ * Starts sending block digests.
+ * 
+ * @param start Memory address of the image.
+ * @param length Image length.
+ * @param size Block size (0 = SMT_DIGEST_BLOCK).
+ * @return Whether the range fits in SM_MAX_SIZE, nothing is started otherwise.
+ */
+bool SMT_digestStart(uint16_t start, uint16_t length, uint8_t size) {
+    if (length > SM_MAX_SIZE - SM_MEM_START) return false;
+    SMT_digest.start = start;
+    SMT_digest.length = length;
+    SMT_digest.block = 0;
+    SMT_digest.size = size > 0 ? size : SMT_DIGEST_BLOCK;
+    return true;
+}
+
+/**
+ * Calculates the CRC-16 of one image block, the status byte excluded.
+ * 
+ * @param block Block index.
+ * @return CRC-16 of the block.
+ */
+uint16_t SMT_blockDigest(uint16_t block) {
+    uint8_t buffer[SM_SCAN_BLOCK_SIZE];
+    uint16_t address = block * SMT_digest.size;
+    uint16_t end = SMT_digest.length - address > SMT_digest.size
+            ? address + SMT_digest.size : SMT_digest.length;
+    uint16_t crc = SM_CRC_INIT;
+    while (address < end) {
+        uint8_t length = end - address > SM_SCAN_BLOCK_SIZE
+                ? SM_SCAN_BLOCK_SIZE : (uint8_t) (end - address);
+        SM_readBlock(SMT_digest.start + address, length, buffer);
+        for (uint8_t i = 0; i < length; i++) {
+            if (address + i > 0) crc = SM_crc16(crc, buffer[i]); // Skip status
+        }
+        address += length;
+    }
+    return crc;
+}
+
+/**
+ * Sends the next packet of block digests.
+ * 
+ * @param channel Channel.
+ * @param mode SMT_CONSISTENCY_DIGEST or SMT_CONSISTENCY_TABLE.
+ * @return Whether all digests were sent.
+ */
+bool SMT_sendDigests(SCOM_Channel_t channel, uint8_t mode) {
+    uint16_t block = SMT_digest.block;
+    uint8_t count = 0;
+    SCOM_addDataByte(channel, 0, MESSAGE_KIND_CONSISTENCY_CHECK);
+    SCOM_addDataByte(channel, 1, SM_DATA_PART);
+    SCOM_addDataByte(channel, 2, mode);
+    SCOM_addDataByte2(channel, 3, block);
+    SCOM_addDataByte(channel, 5, SMT_digest.size);
+    while (count < SMT_DIGEST_COUNT
+            && (uint32_t) (block + count) * SMT_digest.size < SMT_digest.length) {
+        uint16_t crc;
+#ifdef SMT_DIGEST_CACHE_SIZE
+        uint16_t b = block + count;
+        if (mode == SMT_CONSISTENCY_TABLE && SMT_digestCache.size == SMT_digest.size
+                && b < SMT_digestCache.count) {
+            crc = SMT_digestCache.crc[b];
+        } else {
+            crc = SMT_blockDigest(b);
+            if (mode == SMT_CONSISTENCY_TABLE && b < SMT_DIGEST_CACHE_SIZE) {
+                if (SMT_digestCache.size != SMT_digest.size) SMT_digestCache.count = 0;
+                SMT_digestCache.size = SMT_digest.size;
+                if (b == SMT_digestCache.count) SMT_digestCache.crc[SMT_digestCache.count++] = crc;
+            }
+        }
+#else
+        crc = SMT_blockDigest(block + count);
+#endif
+        SCOM_addDataByte2(channel, 6 + count * 2, crc);
+        count++;
+    }
+    if (!SCOM_commitData(channel, 6 + count * 2, SCOM_MAX_SEND_RETRIES)) return false;
+    SMT_digest.block = block + count;
+    return (uint32_t) SMT_digest.block * SMT_digest.size >= SMT_digest.length;
+}
+
+#ifdef SM_TRACE_SIZE
+/**
+ * Sends the next packet of trace entries.
+ * 
+ * @param channel Channel.
+ * @return Whether the packet was sent.
+ */
+bool SMT_sendTrace(SCOM_Channel_t channel) {
+    SM_TraceEntry_t entry;
+    uint8_t count = SM_traceCount();
+    if (count > SMT_TRACE_COUNT) count = SMT_TRACE_COUNT;
+    SCOM_addDataByte(channel, 0, MESSAGE_KIND_SM_TRACE);
+    SCOM_addDataByte(channel, 1, SM_traceCount() - count);
+    SCOM_addDataByte(channel, 2, SM_traceDropped());
+    for (uint8_t i = 0; i < count; i++) {
+        SM_tracePeek(i, &entry);
+        SCOM_addDataByte2(channel, 3 + i * 7, entry.tick);
+        SCOM_addDataByte(channel, 5 + i * 7, entry.state);
+        SCOM_addDataByte(channel, 6 + i * 7, entry.target);
+        SCOM_addDataByte(channel, 7 + i * 7, entry.evaluation);
+        SCOM_addDataByte(channel, 8 + i * 7, entry.inputs);
+        SCOM_addDataByte(channel, 9 + i * 7, entry.actions);
+    }
+    if (!SCOM_commitData(channel, 3 + count * 7, SCOM_MAX_SEND_RETRIES)) return false;
+    SM_traceRemove(count); // Only once sent
+    return true;
+}
+#endif
+
+/**
+ * Stores the image's CRC-16 in its header if the image has a field for it.
+ */
+void SMT_storeCrc(void) {
+    if (!SMT_upload.valid) { // Some bytes missed or repeated, scan the image
+#ifdef SM_SLOTS
+        uint8_t slot = SM_slot;
+        SM_slot = SMT_upload.slot; // Not selected yet
+#endif
+        SM_scanStart(&SMT_upload.crc);
+        while (!SM_scanNext(&SMT_upload.crc, SMT_SCAN_STEP));
+#ifdef SM_SLOTS
+        SM_slot = slot;
+#endif
+    }
+    if (SMT_upload.crc.count == 0x00 && SMT_upload.crc.header >= SM_HEADER_CRC_LENGTH) {
+        SMT_write(SMT_ADDRESS(SM_MEM_START + SM_HEADER_CRC), SMT_upload.crc.crc >> 8);
+        SMT_write(SMT_ADDRESS(SM_MEM_START + SM_HEADER_CRC + 1), SMT_upload.crc.crc & 0xFF);
+    }
+}
+
 /**
  * Transfers next block of a state machine.
  * 
@@ -31,11 +232,15 @@ Procedure_t uploadFinishedCallback = NULL;
  */
 void transmitNextBlock(SCOM_Channel_t channel) {
     if (SCOM_canSend(channel)) {
-        if (SCOM_dataTransfer.end > 0) {
+        if (SCOM_dataTransfer.stage == 0x02) {
             // 32 = CRC(1) + reserve(1)  + MSGTYPE(1) + LEN(2) + ADR(2) + DATA(25)
             SCOM_dataTransfer.start = SCOM_dataTransfer.start + (SMT_BLOCK_SIZE - 7);
-        } else {
-            SCOM_dataTransfer.end = SM_dataLength();
+        } else { // First block, whole image or a part of it
+            uint16_t length = SM_dataLength();
+            if (SCOM_dataTransfer.end == 0 || SCOM_dataTransfer.end > length) {
+                SCOM_dataTransfer.end = length;
+            }
+            SCOM_dataTransfer.stage = 0x02;
         }
 
         if (SCOM_dataTransfer.end > 0
@@ -45,12 +250,12 @@ void transmitNextBlock(SCOM_Channel_t channel) {
             SCOM_addDataByte2(channel, 2, SCOM_dataTransfer.start);
             SCOM_addDataByte2(channel, 4, SCOM_dataTransfer.end);
 
-            for (uint8_t i = 0; i < SMT_BLOCK_SIZE - 7; i++) { // 32 = 25 + 5 + 2
-                if ((SCOM_dataTransfer.start + i) < SCOM_dataTransfer.end) {
-                    SCOM_addDataByte(channel, i + 5,
-                            I2C_readRegister16(SM_MEM_ADDRESS,
-                            SCOM_dataTransfer.start + i));
-                }
+            uint8_t buffer[SMT_BLOCK_SIZE - 7];
+            uint8_t length = (uint8_t) min16(SMT_BLOCK_SIZE - 7,
+                    SCOM_dataTransfer.end - SCOM_dataTransfer.start);
+            SM_readBlock(SM_ADDRESS(SCOM_dataTransfer.start), length, buffer);
+            for (uint8_t i = 0; i < length; i++) { // 32 = 25 + 5 + 2
+                SCOM_addDataByte(channel, i + 5, buffer[i]);
             }
             
             // MSGTYPE(1) + LEN(2) + ADR(2)
@@ -78,6 +283,10 @@ void SMT_bm78AppModeResponseHandler(BM78_Response_t *response) {
         case BM78_EVENT_SPP_CONNECTION_COMPLETE:
             SCOM_dataTransfer.stage = 0x00;
             SCOM_dataTransfer.end = 0; // Cancel state machine transfer
+            SM_trigger(); // Bluetooth connected input changed
+            break;
+        case BM78_EVENT_STATUS_REPORT:
+            SM_trigger(); // Bluetooth connected input may have changed
             break;
         default:
             break;
@@ -87,11 +296,28 @@ void SMT_bm78AppModeResponseHandler(BM78_Response_t *response) {
 void SMT_scomDataHandler(SCOM_Channel_t channel, uint8_t length, uint8_t *data) {
     switch(*(data + 1)) {
         case MESSAGE_KIND_CONSISTENCY_CHECK: // SM checksum requested
-            if (length == 3) switch (*(data + 2)) {
-                case SM_DATA_PART:
+            if (length >= 3) switch (*(data + 2)) {
+                case SM_DATA_PART: {
+                    uint8_t mode = length > 3 ? *(data + 3) : SMT_CONSISTENCY_STORED;
+                    if (mode == SMT_CONSISTENCY_DIGEST && length >= 6) {
+                        // Digests of the memory a delta upload will be written to
+#ifdef SM_SLOTS
+                        SMT_upload.slot = SMT_INACTIVE_SLOT;
+#endif
+                        if (!SMT_digestStart(SMT_ADDRESS(SM_MEM_START),
+                                (*(data + 4) << 8) | (*(data + 5) & 0xFF),
+                                length > 6 ? *(data + 6) : 0)) break;
+                    } else if (mode == SMT_CONSISTENCY_TABLE) {
+                        if (!SMT_digestStart(SM_ADDRESS(SM_MEM_START), SM_dataLength(),
+                                length > 4 ? *(data + 4) : 0)) break;
+                    } else if (mode != SMT_CONSISTENCY_STORED
+                            && mode != SMT_CONSISTENCY_SCAN) {
+                        break;
+                    }
                     SCOM_enqueue(channel, MESSAGE_KIND_CONSISTENCY_CHECK,
-                            SM_DATA_PART, 0x00);
+                            SM_DATA_PART, mode);
                     break;
+                }
             }
             break;
         case MESSAGE_KIND_DATA:
@@ -99,30 +325,50 @@ void SMT_scomDataHandler(SCOM_Channel_t channel, uint8_t length, uint8_t *data)
                 case SM_DATA_PART:
                     if (length == 3) { // Pull
                         SCOM_sendData(channel, SM_DATA_PART, 0x0000, 0x0000);
-                    } else if (length == 6) { // Pull part
-                        // TODO JK: Not implemented
+                    } else if (length == 7) { // Pull part
+                        SCOM_sendData(channel, SM_DATA_PART,
+                                (*(data + 3) << 8) | (*(data + 4) & 0xFF),
+                                (*(data + 5) << 8) | (*(data + 6) & 0xFF));
                     } else if (length > 6) { // Push
-                        uint8_t byte, read;
                         uint16_t startReg = (*(data + 3) << 8) | (*(data + 4) & 0xFF);
                         uint16_t size = (*(data + 5) << 8) | (*(data + 6) & 0xFF);
 
                         if (startReg == 0 && uploadStartCallback) uploadStartCallback();
+                        if (startReg == SM_MEM_START) {
+                            SM_crcStart(&SMT_upload.crc);
+                            SMT_upload.valid = true;
+#ifdef SM_SLOTS
+                            // Upload to the inactive slot, the active one keeps running
+                            SMT_upload.slot = SMT_INACTIVE_SLOT;
+#endif
+                        }
+#ifndef SM_SLOTS
+                        SM_invalidate();
+#endif
+#ifdef SMT_DIGEST_CACHE_SIZE
+                        SMT_digestCache.count = 0;
+#endif
 
+                        uint8_t block[SMT_BLOCK_SIZE];
+                        uint8_t count = 0;
                         for(uint8_t i = 7; i < length; i++) {
-                            // Make sure 1st 2 bytes are 0xFF -> disable state machine
-                            if ((startReg + i - 7) == SM_MEM_START) {
-                                byte = SM_STATUS_DISABLED;
+                            uint16_t reg = startReg + i - 7;
+                            // Calculate the CRC while the bytes arrive in order
+                            if (reg - SM_MEM_START == SMT_upload.crc.offset) {
+                                SM_crcUpdate(&SMT_upload.crc, *(data + i));
                             } else {
-                                byte = *(data + i);
+                                SMT_upload.valid = false;
                             }
 
-                            read = I2C_readRegister16(SM_MEM_ADDRESS, (startReg + i - 7));
-                            bool repeated = false;
-                            while(read != byte) {
-                                if (repeated) __delay_ms(100);
-                                I2C_writeRegister16(SM_MEM_ADDRESS, (startReg + i - 7), byte);
-                                read = I2C_readRegister16(SM_MEM_ADDRESS, (startReg + i - 7));
-                                repeated = true;
+                            // Make sure 1st 2 bytes are 0xFF -> disable state machine
+                            if (reg == SM_MEM_START) {
+                                block[count++] = SM_STATUS_DISABLED;
+                            } else {
+                                block[count++] = *(data + i);
+                            }
+                            if (count == SMT_BLOCK_SIZE || i == length - 1) {
+                                SMT_writeBlock(SMT_ADDRESS(reg + 1 - count), count, block);
+                                count = 0;
                             }
                         }
 
@@ -133,14 +379,17 @@ void SMT_scomDataHandler(SCOM_Channel_t channel, uint8_t length, uint8_t *data)
                         // Finished
                         if (startReg + length - 7 >= size) {
                             // Set 1st 2 bytes on end of transmission -> enable state machine
-                            read = I2C_readRegister16(SM_MEM_ADDRESS, SM_MEM_START);
-                            bool repeated = false;
-                            while (read != SM_STATUS_ENABLED) {
-                                if (repeated) __delay_ms(100);
-                                I2C_writeRegister16(SM_MEM_ADDRESS, SM_MEM_START, SM_STATUS_ENABLED);
-                                read = I2C_readRegister16(SM_MEM_ADDRESS, SM_MEM_START);
-                                repeated = true;
-                            }
+                            SMT_write(SMT_ADDRESS(SM_MEM_START), SM_STATUS_ENABLED);
+                            SMT_storeCrc();
+#ifdef SM_SLOTS
+                            // Switch over to the uploaded image as the last
+                            // step, a reset before boots the previous one
+                            SMT_write(SM_SLOT_SELECTOR, SMT_upload.slot);
+                            SM_selectSlot(SMT_upload.slot);
+#endif
+#ifdef SM_PERSIST_INTERVAL
+                            SM_forget(); // Persisted state of the previous image
+#endif
 
                             if (uploadFinishedCallback) uploadFinishedCallback();
                             SMI_start();
@@ -180,6 +429,11 @@ void SMT_scomDataHandler(SCOM_Channel_t channel, uint8_t length, uint8_t *data)
                 }
             }
             break;
+#ifdef SM_TRACE_SIZE
+        case MESSAGE_KIND_SM_TRACE:
+            if (length == 2) SCOM_enqueue(channel, MESSAGE_KIND_SM_TRACE, 0x00, 0x00);
+            break;
+#endif
     }
 }
 
@@ -193,10 +447,25 @@ bool SMT_scomNextMessageHandler(SCOM_Channel_t channel, uint8_t what,
         case MESSAGE_KIND_CONSISTENCY_CHECK:
             switch (param1) {
                 case SM_DATA_PART:
+                    if (param2 == SMT_CONSISTENCY_DIGEST || param2 == SMT_CONSISTENCY_TABLE) {
+                        return SMT_sendDigests(channel, param2);
+                    }
+                    if (SMT_scan.stage == 0x00 && (param2 != SMT_CONSISTENCY_STORED
+                            || !SM_storedCrc(&SMT_scan.crc.crc))) {
+                        SM_scanStart(&SMT_scan.crc); // Scan if requested or no CRC stored
+                        SMT_scan.stage = 0x01;
+                    }
+                    if (SMT_scan.stage == 0x01) {
+                        // Continue on next call not to block for the whole scan
+                        if (!SM_scanNext(&SMT_scan.crc, SMT_SCAN_STEP)) return false;
+                        SMT_scan.stage = 0x02;
+                    }
                     SCOM_addDataByte(channel, 0, MESSAGE_KIND_CONSISTENCY_CHECK);
                     SCOM_addDataByte(channel, 1, SM_DATA_PART);
-                    SCOM_addDataByte(channel, 2, SM_checksum());
-                    return SCOM_commitData(channel, 3, SCOM_MAX_SEND_RETRIES);
+                    SCOM_addDataByte2(channel, 2, SMT_scan.crc.crc);
+                    if (!SCOM_commitData(channel, 4, SCOM_MAX_SEND_RETRIES)) return false;
+                    SMT_scan.stage = 0x00;
+                    return true;
                 default:
                     return true;  // I have nothing to contribute, consume IMHO
             }
@@ -210,6 +479,10 @@ bool SMT_scomNextMessageHandler(SCOM_Channel_t channel, uint8_t what,
                 default:
                     return true; // I have nothing to contribute, consume IMHO
             }
+#ifdef SM_TRACE_SIZE
+        case MESSAGE_KIND_SM_TRACE:
+            return SMT_sendTrace(channel);
+#endif
         default:
             return true; // I have nothing to contribute, consume IMHO
     }
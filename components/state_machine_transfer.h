@@ -29,6 +29,30 @@ extern "C" {
 #error "SMT: One of SMT_BLOCK_SIZE or SCOM_MAX_PACKET_SIZE must be defined!"
 #endif
 #endif
+
+// Maximum number of bytes scanned per message handler call
+#ifndef SMT_SCAN_STEP
+#define SMT_SCAN_STEP 512
+#endif
+
+// Consistency check modes
+#define SMT_CONSISTENCY_STORED 0x00 // Stored CRC-16 (scan if none stored)
+#define SMT_CONSISTENCY_SCAN 0x01   // Full image scan
+#define SMT_CONSISTENCY_DIGEST 0x02 // Per-block digests for a delta upload
+#define SMT_CONSISTENCY_TABLE 0x03  // Per-block digests of the stored image
+
+// Number of stored image digests cached until the next upload (optional)
+//#define SMT_DIGEST_CACHE_SIZE 32
+
+// Default digest block size, same as the data of one push packet
+#define SMT_DIGEST_BLOCK (SMT_BLOCK_SIZE - 7)
+// Digests per packet: KIND(1) + PART(1) + MODE(1) + BLK(2) + BSZ(1) + 2 each
+#define SMT_DIGEST_COUNT ((SMT_BLOCK_SIZE - 7) / 2)
+
+#ifdef SM_TRACE_SIZE
+// Trace entries per packet: KIND(1) + REM(1) + DRP(1) + 7 each
+#define SMT_TRACE_COUNT ((SMT_BLOCK_SIZE - 4) / 7)
+#endif
     
 /**
  * State machine's BM78 application-mode response handler implementation.
@@ -16,7 +16,18 @@ extern "C" {
 //#define BT_INITIAL_DEVICE_NAME "Bluetooth name\0"
 
 //#define MEM_ADDRESS 0x50
-//#define MEM_SIZE ((uint16_t) 0x7FFF)
+//#define MEM_SIZE 0x7FFF // Plain number, used in #if checks
+//#define I2C_PAGE_SIZE 64 // EEPROM page write size, see modules/i2c.h
+//#define I2C_QUEUE_SIZE 8 // Non-blocking I2C transactions, call I2C_checkQueue() from the main loop (optional, MSSP)
+//#define I2C_QUEUE_DATA_SIZE 4
+//#define I2C_SCL_TRIS TRISCbits.TRISC3 // Bus recovery pins (optional, MSSP)
+//#define I2C_SCL_LAT LATCbits.LATC3
+//#define I2C_SDA_TRIS TRISCbits.TRISC4
+//#define I2C_SDA_LAT LATCbits.LATC4
+//#define I2C_SDA_PORT PORTCbits.RC4
+//#define I2C_STATS_SIZE 4 // Transaction statistics per slave address over SCOM (optional)
+//#define I2C_STATS_TIMER TMR1_ReadTimer() // Free running timer for latencies (optional)
+//#define I2C_STATS_BUCKET 64 // Timer ticks
 
 //#define U1_ADDRESS MCP_START_ADDRESS     // 0x20
 //#define U2_ADDRESS MCP_START_ADDRESS + 1 // 0x21
@@ -93,9 +104,28 @@ extern "C" {
 // see components/state_machine_transfer.h
 //#define SM_MEM_ADDRESS MEM_ADDRESS
 //#define SM_CHECK_DELAY 400 / TIMER_PERIOD // ms
+//#define SM_CHECK_IDLE_INTERVAL 2000 // Check on SM_trigger(), poll as safety net (optional)
+//#define SM_RAM_IMAGE_SIZE 1024 // Decode state machine into RAM (optional)
+//#define SM_INDEX_SIZE 32 // Index evaluations by input bits (optional)
+//#define SM_ACTION_CACHE_SIZE 8 // Cache decoded actions (optional)
+//#define SM_ACTION_CACHE_VALUE_SIZE 8
+//#define SM_STATE_SIZE 9 // Number of input bytes (default 5)
+//#define SM_TIMER_COUNT 4 // Timer actions (optional)
+//#define SM_VERIFY // Verify the image once, evaluate without range checks (optional)
+//#define SM_SLOTS // A/B image slots, upload while running (optional)
+//#define SM_MAX_SIZE 0x3FFF // End of slot A with SM_SLOTS
+//#define SM_REGION_COUNT 4 // Concurrent regions (optional)
+//#define SM_GOTO_HOP_LIMIT 16 // Loop detection by goto count instead of visited states (optional)
+//#define SM_PERSIST_INTERVAL 5000 // Persist current state, resume after reset (optional)
+//#define SM_PERSIST_ADDRESS 0x7FC0 // Outside of the image, default after slot selector
+//#define SM_TRACE_SIZE 16 // Evaluation trace streamed over SCOM (optional)
+//#define SM_CONDITION_OPCODES // Edge, change, inequality and held conditions (optional)
+//#define SM_HELD_UNIT 100 // ms, same as sm_compiler -u
 //#define SM_BLOCK_SIZE 64
 //#define SM_IN1_ADDRESS U1_ADDRESS
 //#define SM_IN2_ADDRESS U2_ADDRESS
+//#define SM_IN3_ADDRESS U4_ADDRESS // Needs SM_STATE_SIZE >= 7 (optional)
+//#define SM_IN4_ADDRESS U5_ADDRESS // Needs SM_STATE_SIZE >= 9 (optional)
 //#define SM_OUT_ADDRESS U3_ADDRESS
 //#define SM_OUT_PORT MCP_GPIOA
     
@@ -105,6 +105,9 @@ typedef enum {
     MESSAGE_KIND_LCD = 0x12,
 #endif
     MESSAGE_KIND_REGISTRY = 0x13,
+#ifdef I2C_STATS_SIZE
+    MESSAGE_KIND_I2C_STATS = 0x14,
+#endif
 #ifdef RGB_ENABLED
     MESSAGE_KIND_RGB = 0x15,
 #endif
@@ -122,6 +125,9 @@ typedef enum {
 #ifdef SM_MEM_ADDRESS
     MESSAGE_KIND_SM_STATE_ACTION = 0x80,
     MESSAGE_KIND_SM_INPUT = 0x81,
+#ifdef SM_TRACE_SIZE
+    MESSAGE_KIND_SM_TRACE = 0x82,
+#endif
 #endif
     MESSAGE_KIND_DEBUG = 0xFE,
     MESSAGE_KIND_NONE = 0xFF    
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "mclib/project.h"
+#include "mclib/modules/i2c.h"
 
 
 void main(void) {
@@ -20,6 +21,9 @@ void main(void) {
     //INTERRUPT_PeripheralInterruptDisable(); // Disable the Peripheral Interrupts
     
     while(1) {
+#ifdef I2C_QUEUE_SIZE
+        I2C_checkQueue(); // Complete queued I2C transactions (e.g. LCD)
+#endif
         // TODO Implement main loop
     }
 }
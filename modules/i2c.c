@@ -8,6 +8,208 @@
 
 #ifdef I2C_MSSP
 uint8_t writeBuffer[3];
+bool I2C_ready = false; // Whether the MSSP is initialized
+#endif
+uint8_t I2C_pageBuffer[I2C_PAGE_SIZE + 2];
+
+#ifdef I2C_MSSP
+/**
+ * Initializes the MSSP on the first transaction and after a recovery.
+ */
+inline void I2C_begin(void) {
+    if (!I2C_ready) {
+        I2C1_Initialize();
+        I2C_ready = true;
+    }
+}
+
+/**
+ * Recovers from a stuck bus or a bus error. The MSSP is stopped, so a
+ * timed-out transaction cannot complete later. A slave holding SDA low, e.g.
+ * after a reset in the middle of a read, is clocked out by up to 9 SCL
+ * pulses and the bus is released by a STOP condition. The MSSP is
+ * re-initialized on the next transaction.
+ */
+void I2C_recover(void) {
+    SSP1CON1bits.SSPEN = 0; // Release the pins from the MSSP
+#ifdef I2C_SCL_TRIS
+    I2C_SCL_LAT = 0;        // Open drain: TRIS = 0 pulls low, 1 releases
+    I2C_SDA_LAT = 0;
+    I2C_SDA_TRIS = 1;
+    for (uint8_t i = 0; i < 9 && !I2C_SDA_PORT; i++) {
+        I2C_SCL_TRIS = 0;
+        __delay_us(5);
+        I2C_SCL_TRIS = 1;
+        __delay_us(5);
+    }
+    I2C_SCL_TRIS = 0; // STOP: SDA rises while SCL is high
+    I2C_SDA_TRIS = 0;
+    __delay_us(5);
+    I2C_SCL_TRIS = 1;
+    __delay_us(5);
+    I2C_SDA_TRIS = 1;
+    __delay_us(5);
+#endif
+    I2C_ready = false;
+}
+
+// Bus errors, unlike a NACK of a busy (e.g. EEPROM write cycle) or a missing
+// slave
+#define I2C_BUS_ERROR(status) ((status) != I2C1_MESSAGE_COMPLETE \
+        && (status) != I2C1_MESSAGE_ADDRESS_NO_ACK && (status) != I2C1_DATA_NO_ACK)
+// Unless already recovered after a timeout
+#define I2C_RECOVER_ON_ERROR(status) if (I2C_BUS_ERROR(status) && I2C_ready) I2C_recover()
+
+/**
+ * Waits for a free slot in the MSSP queue. A bus held low never drains the
+ * queue, the wait is bounded by I2C_TIMEOUT and the bus recovered then.
+ * 
+ * @return I2C1_MESSAGE_PENDING to start the transaction or
+ *         I2C1_MESSAGE_FAIL on timeout.
+ */
+I2C1_MESSAGE_STATUS I2C_waitQueue(void) {
+    uint16_t wait = 0;
+    while(I2C1_MasterQueueIsFull()) {
+        if (++wait == I2C_TIMEOUT) {
+            I2C_recover();
+            return I2C1_MESSAGE_FAIL;
+        }
+    }
+    return I2C1_MESSAGE_PENDING;
+}
+
+/**
+ * Waits for a transaction to finish. A bus held low never finishes it, the
+ * wait is bounded by I2C_TIMEOUT and the bus recovered then.
+ * 
+ * @param status Transaction's status, I2C1_MESSAGE_FAIL on timeout.
+ */
+void I2C_wait(I2C1_MESSAGE_STATUS *status) {
+    uint16_t wait = 0;
+    while(*((volatile I2C1_MESSAGE_STATUS *) status) == I2C1_MESSAGE_PENDING) {
+        if (++wait == I2C_TIMEOUT) {
+            I2C_recover(); // Stops the MSSP before giving up the status
+            *status = I2C1_MESSAGE_FAIL;
+            return;
+        }
+    }
+}
+#endif
+
+#if defined I2C_QUEUE_SIZE && defined I2C_MSSP
+typedef struct {
+    I2C1_TRANSACTION_REQUEST_BLOCK trb[2];
+    I2C1_MESSAGE_STATUS status;
+    uint8_t data[I2C_QUEUE_DATA_SIZE]; // Copy of the written data
+    uint8_t count;                     // Number of TRBs
+    bool inserted;                     // Whether passed to the MSSP queue
+    uint8_t retries;
+#ifdef I2C_STATS_SIZE
+    uint8_t address; // 7-bit slave address (the TRBs hold it shifted)
+    uint16_t start;  // Timer at the submission
+    uint8_t nacks;
+#endif
+    I2C_Callback_t callback;
+} I2C_Transaction_t;
+
+struct {
+    I2C_Transaction_t transactions[I2C_QUEUE_SIZE];
+    uint8_t head;  // Oldest transaction
+    uint8_t count; // Number of queued transactions
+    uint16_t wait; // Polls of the pending oldest transaction
+} I2C_queue = { {{{{0}}}}, 0, 0, 0 };
+
+// Blocking MSSP transactions must not overtake or reset queued ones
+#define I2C_SYNC() I2C_flush()
+#else
+#define I2C_SYNC()
+#endif
+
+#ifdef I2C_STATS_SIZE
+I2C_Stats_t I2C_statistics[I2C_STATS_SIZE];
+
+struct {
+    uint16_t start; // Timer at the start of the blocking transaction
+    uint8_t nacks;  // Not acknowledged attempts of the blocking transaction
+} I2C_current = { 0, 0 };
+
+#ifdef I2C_STATS_TIMER
+#define I2C_STATS_NOW ((uint16_t) (I2C_STATS_TIMER))
+#else
+#define I2C_STATS_NOW 0
+#endif
+#if defined I2C_MSSP
+#define I2C_STATS_IS_NACK(status) ((status) == I2C1_MESSAGE_ADDRESS_NO_ACK \
+        || (status) == I2C1_DATA_NO_ACK)
+#endif
+#define I2C_STATS_ADD(counter, value) counter = (counter) > 0xFFFF - (value) \
+        ? 0xFFFF : (counter) + (value) // Saturating
+#define I2C_STATS_BEGIN() I2C_current.start = I2C_STATS_NOW; I2C_current.nacks = 0
+#define I2C_STATS_NACK(status) if (I2C_STATS_IS_NACK(status)) I2C_current.nacks++
+#define I2C_STATS_END(address, bytes, retries, success) I2C_statsRecord(address, \
+        bytes, retries, I2C_current.nacks, success, I2C_current.start)
+
+/**
+ * Records a finished transaction in the statistics of its slave address.
+ * Addresses not fitting in I2C_STATS_SIZE slots are not recorded.
+ * 
+ * @param address I2C device's address.
+ * @param bytes Number of written and read bytes.
+ * @param retries Number of retries.
+ * @param nacks Number of not acknowledged attempts.
+ * @param success Whether the transaction completed.
+ * @param start Timer at the start of the transaction.
+ */
+void I2C_statsRecord(uint8_t address, uint16_t bytes, uint8_t retries,
+        uint8_t nacks, bool success, uint16_t start) {
+    I2C_Stats_t *stats = NULL;
+    for (uint8_t i = 0; i < I2C_STATS_SIZE && stats == NULL; i++) {
+        if (I2C_statistics[i].address == address || I2C_statistics[i].address == 0x00) {
+            stats = &I2C_statistics[i];
+        }
+    }
+    if (stats == NULL) return;
+
+    stats->address = address;
+    I2C_STATS_ADD(stats->transactions, 1);
+    I2C_STATS_ADD(stats->bytes, bytes);
+    I2C_STATS_ADD(stats->retries, retries);
+    I2C_STATS_ADD(stats->nacks, nacks);
+    if (!success) I2C_STATS_ADD(stats->failures, 1);
+#ifdef I2C_STATS_TIMER
+    uint16_t ticks = I2C_STATS_NOW - start;
+    uint16_t bound = I2C_STATS_BUCKET;
+    uint8_t bucket = 0;
+    while (bucket < I2C_STATS_BUCKETS - 1 && ticks >= bound) {
+        bucket++;
+        bound = bound > 0x3FFF ? 0xFFFF : bound << 2;
+    }
+    I2C_STATS_ADD(stats->latency[bucket], 1);
+#endif
+}
+
+I2C_Stats_t *I2C_stats(uint8_t index) {
+    return index < I2C_STATS_SIZE && I2C_statistics[index].address != 0x00
+            ? &I2C_statistics[index] : NULL;
+}
+
+void I2C_statsClear(void) {
+    for (uint8_t i = 0; i < I2C_STATS_SIZE; i++) {
+        I2C_statistics[i].address = 0x00;
+        I2C_statistics[i].transactions = 0;
+        I2C_statistics[i].bytes = 0;
+        I2C_statistics[i].retries = 0;
+        I2C_statistics[i].nacks = 0;
+        I2C_statistics[i].failures = 0;
+#ifdef I2C_STATS_TIMER
+        for (uint8_t j = 0; j < I2C_STATS_BUCKETS; j++) I2C_statistics[i].latency[j] = 0;
+#endif
+    }
+}
+#else
+#define I2C_STATS_BEGIN()
+#define I2C_STATS_NACK(status)
+#define I2C_STATS_END(address, bytes, retries, success)
 #endif
 //if defined I2C_MSSP_FOUNDATION
 //    i2c1_driver_open();
@@ -17,10 +219,10 @@ inline uint8_t I2C_readRegister(uint8_t address, uint8_t reg) {
 #if defined I2C_MSSP
     uint8_t byte;
     
-    I2C1_Initialize();
-    while(I2C1_MasterQueueIsFull());
-    
-    I2C1_MESSAGE_STATUS status = I2C1_MESSAGE_PENDING;
+    I2C_SYNC();
+    I2C_begin();
+    I2C_STATS_BEGIN();
+    I2C1_MESSAGE_STATUS status = I2C_waitQueue();
     I2C1_TRANSACTION_REQUEST_BLOCK trb[2];
     writeBuffer[0] = reg;
     I2C1_MasterWriteTRBBuild(&trb[0], writeBuffer, 1, address);
@@ -28,18 +230,26 @@ inline uint8_t I2C_readRegister(uint8_t address, uint8_t reg) {
     uint8_t timeout = 0;
     while(status != I2C1_MESSAGE_FAIL) {
         I2C1_MasterTRBInsert(2, trb, &status);
-        while(status == I2C1_MESSAGE_PENDING);
+        I2C_wait(&status);
+        I2C_STATS_NACK(status);
         if (status == I2C1_MESSAGE_COMPLETE || timeout == I2C_MAX_RETRIES) {
             break;
         } else {
             timeout++;
         }
     }
+    I2C_RECOVER_ON_ERROR(status);
+    I2C_STATS_END(address, 2, timeout, status == I2C1_MESSAGE_COMPLETE);
     return byte;
-#elif defined I2C_MSSP_FOUNDATION
-    return i2c_read1ByteRegister(address, reg);
 #else
-    return i2c1_read1ByteRegister(address, reg);
+    I2C_STATS_BEGIN();
+#if defined I2C_MSSP_FOUNDATION
+    uint8_t byte = i2c_read1ByteRegister(address, reg);
+#else
+    uint8_t byte = i2c1_read1ByteRegister(address, reg);
+#endif
+    I2C_STATS_END(address, 2, 0, true);
+    return byte;
 #endif
 }
 
@@ -47,10 +257,10 @@ inline uint8_t I2C_readRegister2(uint8_t address, uint8_t regHigh, uint8_t regLo
 #if defined I2C_MSSP
     uint8_t byte;
     
-    I2C1_Initialize();
-    while(I2C1_MasterQueueIsFull());
-    
-    I2C1_MESSAGE_STATUS status = I2C1_MESSAGE_PENDING;
+    I2C_SYNC();
+    I2C_begin();
+    I2C_STATS_BEGIN();
+    I2C1_MESSAGE_STATUS status = I2C_waitQueue();
     I2C1_TRANSACTION_REQUEST_BLOCK trb[2];
     writeBuffer[0] = regHigh;
     writeBuffer[1] = regLow;
@@ -59,77 +269,141 @@ inline uint8_t I2C_readRegister2(uint8_t address, uint8_t regHigh, uint8_t regLo
     uint8_t timeout = 0;
     while(status != I2C1_MESSAGE_FAIL) {
         I2C1_MasterTRBInsert(2, trb, &status);
-        while(status == I2C1_MESSAGE_PENDING);
+        I2C_wait(&status);
+        I2C_STATS_NACK(status);
         if (status == I2C1_MESSAGE_COMPLETE || timeout == I2C_MAX_RETRIES) {
             break;
         } else {
             timeout++;
         }
     }
+    I2C_RECOVER_ON_ERROR(status);
+    I2C_STATS_END(address, 3, timeout, status == I2C1_MESSAGE_COMPLETE);
     return byte;
-#elif defined I2C_MSSP_FOUNDATION
-    return i2c_read1ByteRegister2(address, regHigh, regLow);
 #else
-    return i2c1_read1ByteRegister2(address, regHigh, regLow);
+    I2C_STATS_BEGIN();
+#if defined I2C_MSSP_FOUNDATION
+    uint8_t byte = i2c_read1ByteRegister2(address, regHigh, regLow);
+#else
+    uint8_t byte = i2c1_read1ByteRegister2(address, regHigh, regLow);
+#endif
+    I2C_STATS_END(address, 3, 0, true);
+    return byte;
 #endif
 }
 
 inline uint8_t I2C_readRegister16(uint8_t address, uint16_t reg) {
-#if defined I2C_MSSP
     return I2C_readRegister2(address, reg >> 8, reg & 0xFF);
-#elif defined I2C_MSSP_FOUNDATION
-    return i2c_read1ByteRegister2(address, reg >> 8, reg & 0xFF);
+}
+
+inline void I2C_readBlock16(uint8_t address, uint16_t reg, uint8_t len, uint8_t *buf) {
+    if (len == 0) return;
+#if defined I2C_MSSP
+    I2C_SYNC();
+    I2C_begin();
+    I2C_STATS_BEGIN();
+    I2C1_MESSAGE_STATUS status = I2C_waitQueue();
+    I2C1_TRANSACTION_REQUEST_BLOCK trb[2];
+    writeBuffer[0] = reg >> 8;
+    writeBuffer[1] = reg & 0xFF;
+    I2C1_MasterWriteTRBBuild(&trb[0], writeBuffer, 2, address);
+    I2C1_MasterReadTRBBuild(&trb[1], buf, len, address);
+    uint8_t timeout = 0;
+    while(status != I2C1_MESSAGE_FAIL) {
+        I2C1_MasterTRBInsert(2, trb, &status);
+        I2C_wait(&status);
+        I2C_STATS_NACK(status);
+        if (status == I2C1_MESSAGE_COMPLETE || timeout == I2C_MAX_RETRIES) {
+            break;
+        } else {
+            timeout++;
+        }
+    }
+    I2C_RECOVER_ON_ERROR(status);
+    I2C_STATS_END(address, 2 + len, timeout, status == I2C1_MESSAGE_COMPLETE);
+#else
+    uint8_t regBuffer[2];
+    regBuffer[0] = reg >> 8;
+    regBuffer[1] = reg & 0xFF;
+    I2C_STATS_BEGIN();
+#if defined I2C_MSSP_FOUNDATION
+    // Set the internal address pointer, then read from the current address
+    i2c_writeNBytes(address, regBuffer, 2);
+    i2c_readNBytes(address, buf, len);
 #else
-    return i2c1_read1ByteRegister2(address, reg >> 8, reg & 0xFF);
-#endif 
+    i2c1_writeNBytes(address, regBuffer, 2);
+    i2c1_readNBytes(address, buf, len);
+#endif
+    I2C_STATS_END(address, 2 + len, 0, true);
+#endif
 }
 
 inline void I2C_writeByte(uint8_t address, uint8_t byte) {
 #if defined I2C_MSSP
-    I2C1_MESSAGE_STATUS status = I2C1_MESSAGE_PENDING;
+    I2C_SYNC();
+    I2C_begin();
+    I2C_STATS_BEGIN();
+    I2C1_MESSAGE_STATUS status = I2C_waitQueue();
     uint8_t timeout = 0;
     while(status != I2C1_MESSAGE_FAIL) {
         I2C1_MasterWrite(&byte, 1, address, &status);
-        while(status == I2C1_MESSAGE_PENDING);
+        I2C_wait(&status);
+        I2C_STATS_NACK(status);
         if (status == I2C1_MESSAGE_COMPLETE || timeout == I2C_MAX_RETRIES) {
             break;
         }
         timeout++;
     }
-#elif defined I2C_MSSP_FOUNDATION
+    I2C_RECOVER_ON_ERROR(status);
+    I2C_STATS_END(address, 1, timeout, status == I2C1_MESSAGE_COMPLETE);
+#else
+    I2C_STATS_BEGIN();
+#if defined I2C_MSSP_FOUNDATION
     i2c_writeNBytes(address, &byte, 1);
 #else
     i2c1_writeNBytes(address, &byte, 1);
+#endif
+    I2C_STATS_END(address, 1, 0, true);
 #endif
 }
 
 inline void I2C_writeRegister(uint8_t address, uint8_t reg, uint8_t byte) {
 #if defined I2C_MSSP
-    I2C1_Initialize();
-    while(I2C1_MasterQueueIsFull());
-
-    I2C1_MESSAGE_STATUS status = I2C1_MESSAGE_PENDING;
+    I2C_SYNC();
+    I2C_begin();
+    I2C_STATS_BEGIN();
+    I2C1_MESSAGE_STATUS status = I2C_waitQueue();
     writeBuffer[0] = reg;
     writeBuffer[1] = byte;
     uint8_t timeout = 0;
     while(status != I2C1_MESSAGE_FAIL) {
         I2C1_MasterWrite(writeBuffer, 2, address, &status);
-        while(status == I2C1_MESSAGE_PENDING);
+        I2C_wait(&status);
+        I2C_STATS_NACK(status);
         if (status == I2C1_MESSAGE_COMPLETE || timeout == I2C_MAX_RETRIES) {
             break;
         }
         timeout++;
     }
-#elif defined I2C_MSSP_FOUNDATION
+    I2C_RECOVER_ON_ERROR(status);
+    I2C_STATS_END(address, 2, timeout, status == I2C1_MESSAGE_COMPLETE);
+#else
+    I2C_STATS_BEGIN();
+#if defined I2C_MSSP_FOUNDATION
     i2c_write1ByteRegister(address, reg, byte);
 #else
     i2c1_write1ByteRegister(address, reg, byte);
+#endif
+    I2C_STATS_END(address, 2, 0, true);
 #endif
 }
 
 inline void I2C_writeRegister2(uint8_t address, uint8_t regHigh, uint8_t regLow, uint8_t byte) {
 #if defined I2C_MSSP
-    I2C1_MESSAGE_STATUS status = I2C1_MESSAGE_PENDING;
+    I2C_SYNC();
+    I2C_begin();
+    I2C_STATS_BEGIN();
+    I2C1_MESSAGE_STATUS status = I2C_waitQueue();
 
     // build the write buffer first
     // starting address of the EEPROM memory
@@ -148,7 +422,8 @@ inline void I2C_writeRegister2(uint8_t address, uint8_t regHigh, uint8_t regLow,
         I2C1_MasterWrite(writeBuffer, 3, address, &status);
 
         // wait for the message to be sent or status has changed.
-        while(status == I2C1_MESSAGE_PENDING);
+        I2C_wait(&status);
+        I2C_STATS_NACK(status);
 
         // if status is  I2C1_MESSAGE_ADDRESS_NO_ACK, or I2C1_DATA_NO_ACK,
         // The device may be busy and needs more time for the last write so
@@ -160,10 +435,16 @@ inline void I2C_writeRegister2(uint8_t address, uint8_t regHigh, uint8_t regLow,
         }
         timeout++;
     }
-#elif defined I2C_MSSP_FOUNDATION
+    I2C_RECOVER_ON_ERROR(status);
+    I2C_STATS_END(address, 3, timeout, status == I2C1_MESSAGE_COMPLETE);
+#else
+    I2C_STATS_BEGIN();
+#if defined I2C_MSSP_FOUNDATION
     i2c_write1ByteRegister2(address, regHigh, regLow, byte);
 #else
     i2c1_write1ByteRegister2(address, regHigh, regLow, byte);
+#endif
+    I2C_STATS_END(address, 3, 0, true);
 #endif
 }
 
@@ -171,18 +452,75 @@ inline void I2C_writeRegister16(uint8_t address, uint16_t reg, uint8_t byte) {
     I2C_writeRegister2(address, reg >> 8, reg & 0xFF, byte);
 }
 
+/**
+ * Waits until the EEPROM finished its internal write cycle. The device does
+ * not acknowledge its address until then. Writing only the register bytes
+ * sets the address pointer without starting a new write cycle.
+ * 
+ * @param address I2C device's address.
+ * @param reg Register to point to.
+ */
+void I2C_ackPoll(uint8_t address, uint16_t reg) {
+    uint8_t regBuffer[2];
+    regBuffer[0] = reg >> 8;
+    regBuffer[1] = reg & 0xFF;
+#if defined I2C_MSSP
+    I2C_SYNC();
+    I2C_begin();
+    I2C_STATS_BEGIN();
+    I2C1_MESSAGE_STATUS status = I2C_waitQueue();
+    uint8_t timeout = 0;
+    while(status != I2C1_MESSAGE_FAIL) {
+        I2C1_MasterWrite(regBuffer, 2, address, &status);
+        I2C_wait(&status);
+        I2C_STATS_NACK(status);
+        if (status == I2C1_MESSAGE_COMPLETE || timeout == I2C_MAX_RETRIES) {
+            break;
+        }
+        timeout++;
+    }
+    I2C_RECOVER_ON_ERROR(status);
+    I2C_STATS_END(address, 2, timeout, status == I2C1_MESSAGE_COMPLETE);
+#else
+    I2C_STATS_BEGIN();
+#if defined I2C_MSSP_FOUNDATION
+    i2c_writeNBytes(address, regBuffer, 2); // Restarts on address NACK
+#else
+    i2c1_writeNBytes(address, regBuffer, 2); // Restarts on address NACK
+#endif
+    I2C_STATS_END(address, 2, 0, true);
+#endif
+}
+
+inline void I2C_writePage16(uint8_t address, uint16_t reg, uint8_t len, uint8_t *data) {
+    while (len > 0) {
+        uint8_t size = I2C_PAGE_SIZE - (reg % I2C_PAGE_SIZE);
+        if (size > len) size = len;
+        I2C_pageBuffer[0] = reg >> 8;
+        I2C_pageBuffer[1] = reg & 0xFF;
+        for (uint8_t i = 0; i < size; i++) I2C_pageBuffer[i + 2] = *(data + i);
+        I2C_writeData(address, size + 2, I2C_pageBuffer);
+        reg += size;
+        data += size;
+        len -= size;
+        I2C_ackPoll(address, reg);
+    }
+}
+
 inline void I2C_writeData(uint8_t address, uint8_t len, uint8_t *data) {
 #if defined I2C_MSSP
-    I2C1_Initialize();
-    while(I2C1_MasterQueueIsFull());
-    I2C1_MESSAGE_STATUS status = I2C1_MESSAGE_PENDING;
+    I2C_SYNC();
+    I2C_begin();
+    I2C_STATS_BEGIN();
+    I2C1_MESSAGE_STATUS status = I2C_waitQueue();
     uint8_t timeout = 0;
     while(status != I2C1_MESSAGE_FAIL) {
         // write one byte to EEPROM (3 is the number of bytes to write)
         I2C1_MasterWrite(data, len, address, &status);
 
         // wait for the message to be sent or status has changed.
-        while(status == I2C1_MESSAGE_PENDING);
+        I2C_wait(&status);
+        I2C_STATS_NACK(status);
 
         // if status is  I2C1_MESSAGE_ADDRESS_NO_ACK, or I2C1_DATA_NO_ACK,
         // The device may be busy and needs more time for the last write so
@@ -194,11 +532,133 @@ inline void I2C_writeData(uint8_t address, uint8_t len, uint8_t *data) {
         }
         timeout++;
     }
-#elif defined I2C_MSSP_FOUNDATION
+    I2C_RECOVER_ON_ERROR(status);
+    I2C_STATS_END(address, len, timeout, status == I2C1_MESSAGE_COMPLETE);
+#else
+    I2C_STATS_BEGIN();
+#if defined I2C_MSSP_FOUNDATION
     i2c_writeNBytes(address, data, len);
 #else
     i2c1_writeNBytes(address, data, len);
+#endif
+    I2C_STATS_END(address, len, 0, true);
+#endif
+}
+
+#ifdef I2C_QUEUE_SIZE
+bool I2C_submit(uint8_t address, uint8_t writeLength, uint8_t *data,
+        uint8_t readLength, uint8_t *read, I2C_Callback_t callback) {
+    if (writeLength > I2C_QUEUE_DATA_SIZE) return false;
+    if (writeLength == 0 && readLength == 0) return false;
+#if defined I2C_MSSP
+    if (I2C_queue.count >= I2C_QUEUE_SIZE) return false;
+    if (I2C_queue.count == 0) I2C_begin(); // Not while transactions are queued
+    uint8_t index = (I2C_queue.head + I2C_queue.count) % I2C_QUEUE_SIZE;
+    I2C_Transaction_t *transaction = &I2C_queue.transactions[index];
+
+    transaction->count = 0;
+    if (writeLength > 0) {
+        for (uint8_t i = 0; i < writeLength; i++) {
+            transaction->data[i] = *(data + i);
+        }
+        I2C1_MasterWriteTRBBuild(&transaction->trb[transaction->count++],
+                transaction->data, writeLength, address);
+    }
+    if (readLength > 0) {
+        I2C1_MasterReadTRBBuild(&transaction->trb[transaction->count++],
+                read, readLength, address);
+    }
+    transaction->retries = 0;
+#ifdef I2C_STATS_SIZE
+    transaction->address = address;
+    transaction->start = I2C_STATS_NOW;
+    transaction->nacks = 0;
+#endif
+    transaction->callback = callback;
+    transaction->status = I2C1_MESSAGE_PENDING;
+    transaction->inserted = false;
+    I2C_queue.count++;
+    if (I2C_queue.count == 1) I2C_checkQueue(); // Start right away if idle
+#else
+    if (writeLength > 0) I2C_writeData(address, writeLength, data);
+    if (readLength > 0) {
+        I2C_STATS_BEGIN();
+#if defined I2C_MSSP_FOUNDATION
+        i2c_readNBytes(address, read, readLength);
+#else
+        i2c1_readNBytes(address, read, readLength);
+#endif
+        I2C_STATS_END(address, readLength, 0, true);
+    }
+    if (callback) callback(true);
+#endif
+    return true;
+}
+
+bool I2C_pending(void) {
+#if defined I2C_MSSP
+    return I2C_queue.count > 0;
+#else
+    return false;
 #endif
 }
 
-#endif
\ No newline at end of file
+void I2C_checkQueue(void) {
+#if defined I2C_MSSP
+    while (I2C_queue.count > 0) {
+        I2C_Transaction_t *transaction = &I2C_queue.transactions[I2C_queue.head];
+        if (!transaction->inserted) {
+            // Only the oldest transaction is on the bus, so a retry cannot
+            // be overtaken by the following ones
+            I2C_begin(); // After a recovery
+            if (!I2C1_MasterQueueIsFull()) {
+                I2C_queue.wait = 0;
+                transaction->inserted = true;
+                I2C1_MasterTRBInsert(transaction->count, transaction->trb, &transaction->status);
+            }
+            return;
+        }
+        I2C1_MESSAGE_STATUS status = transaction->status;
+        if (status == I2C1_MESSAGE_PENDING) {
+            if (++I2C_queue.wait < I2C_TIMEOUT) return;
+            I2C_recover(); // Bus stuck, stops the MSSP before failing
+            status = I2C1_MESSAGE_FAIL;
+            transaction->status = status;
+        }
+        if (status != I2C1_MESSAGE_COMPLETE && status != I2C1_MESSAGE_FAIL
+                && transaction->retries < I2C_MAX_RETRIES) {
+            // Device busy, e.g. EEPROM write cycle
+            if (!I2C1_MasterQueueIsFull()) {
+                I2C_queue.wait = 0;
+#ifdef I2C_STATS_SIZE
+                if (I2C_STATS_IS_NACK(status)) transaction->nacks++;
+#endif
+                transaction->retries++;
+                transaction->status = I2C1_MESSAGE_PENDING;
+                I2C1_MasterTRBInsert(transaction->count, transaction->trb, &transaction->status);
+            }
+            return;
+        }
+
+        I2C_Callback_t callback = transaction->callback;
+#ifdef I2C_STATS_SIZE
+        if (I2C_STATS_IS_NACK(status)) transaction->nacks++;
+        I2C_statsRecord(transaction->address,
+                transaction->trb[0].length + (transaction->count > 1 ? transaction->trb[1].length : 0),
+                transaction->retries, transaction->nacks,
+                status == I2C1_MESSAGE_COMPLETE, transaction->start);
+#endif
+        I2C_queue.head = (I2C_queue.head + 1) % I2C_QUEUE_SIZE;
+        I2C_queue.count--;
+        I2C_RECOVER_ON_ERROR(status);
+        if (callback) callback(status == I2C1_MESSAGE_COMPLETE);
+    }
+#endif
+}
+
+void I2C_flush(void) {
+    while (I2C_pending()) I2C_checkQueue();
+}
+#endif
+
+#endif
@@ -33,6 +33,120 @@ extern "C" {
 #define I2C_MAX_RETRIES 100
 #endif
 
+// Busy-wait iterations (I2C_MSSP) for a transaction or a free MSSP queue slot,
+// or I2C_checkQueue() calls for a queued transaction, before the bus is
+// considered stuck and recovered. A NACK is retried and never recovers the
+// bus.
+#if defined I2C_MSSP && !defined I2C_TIMEOUT
+#define I2C_TIMEOUT 0xFFFF
+#endif
+
+// PIN Configuration for clocking out a slave holding SDA low during the bus
+// recovery (I2C_MSSP, optional):
+//I2C_SCL_TRIS, I2C_SCL_LAT
+//I2C_SDA_TRIS, I2C_SDA_LAT, I2C_SDA_PORT
+
+// EEPROM page size, page writes are split on page boundaries. 32 fits 24LC32
+// to 24LC512 (64 on 24LC256/512 and 128 on 24LC512 are multiples of it).
+#ifndef I2C_PAGE_SIZE
+#define I2C_PAGE_SIZE 32
+#endif
+
+#ifdef I2C_STATS_SIZE
+#ifdef I2C_STATS_TIMER
+// Upper bound of the first latency bucket in I2C_STATS_TIMER ticks, each
+// next bucket is 4 times wider and the last one is unbounded.
+#ifndef I2C_STATS_BUCKET
+#define I2C_STATS_BUCKET 64
+#endif
+#define I2C_STATS_BUCKETS 4
+#endif
+
+typedef struct {
+    uint8_t address;       // Slave address (0x00 = unused)
+    uint16_t transactions;
+    uint16_t bytes;        // Written and read bytes (slave address excluded)
+    uint16_t retries;
+    uint16_t nacks;        // Not acknowledged attempts (I2C_MSSP only)
+    uint16_t failures;     // Transactions not completed after all retries
+#ifdef I2C_STATS_TIMER
+    uint16_t latency[I2C_STATS_BUCKETS]; // Latency histogram
+#endif
+} I2C_Stats_t;
+
+/**
+ * Transaction statistics of a slave address. Slots are assigned to slave
+ * addresses in order of their first transaction. All counters saturate at
+ * 0xFFFF.
+ * 
+ * @param index Slot index (< I2C_STATS_SIZE).
+ * @return Statistics or NULL if the slot is not used.
+ */
+I2C_Stats_t *I2C_stats(uint8_t index);
+
+/**
+ * Clears all statistics.
+ */
+void I2C_statsClear(void);
+#endif
+
+#ifdef I2C_QUEUE_SIZE
+// Maximum number of bytes written by one queued transaction
+#ifndef I2C_QUEUE_DATA_SIZE
+#define I2C_QUEUE_DATA_SIZE 4
+#endif
+
+/**
+ * Completion callback of a queued transaction.
+ * 
+ * @param success Whether the transaction was acknowledged by the device.
+ */
+typedef void (*I2C_Callback_t)(bool success);
+
+/**
+ * Queues a transaction without waiting for it. The data are written to the
+ * device first, then readLength bytes are read into the read buffer after a
+ * repeated start. The read buffer must stay valid until the completion.
+ * 
+ * With I2C_MSSP the transaction is processed by the MSSP interrupt and the
+ * callback is called from I2C_checkQueue(). Other backends execute it
+ * immediately and call the callback before returning.
+ * 
+ * @param address I2C device's address.
+ * @param writeLength Number of bytes to write (max. I2C_QUEUE_DATA_SIZE).
+ * @param data Data to write (copied).
+ * @param readLength Number of bytes to read (0 = write only).
+ * @param read Read buffer.
+ * @param callback Completion callback (optional).
+ * @return Whether the transaction was queued, false when the queue is full.
+ */
+bool I2C_submit(uint8_t address, uint8_t writeLength, uint8_t *data,
+        uint8_t readLength, uint8_t *read, I2C_Callback_t callback);
+
+/**
+ * Whether there are queued transactions not yet checked by I2C_checkQueue().
+ * 
+ * @return True if any transaction is still in the queue.
+ */
+bool I2C_pending(void);
+
+/**
+ * Passes the oldest transaction to the MSSP, retries it if not acknowledged
+ * (at most I2C_MAX_RETRIES times) and completes it. Transactions reach the
+ * bus one at a time in the order they were queued. A transaction still
+ * pending after I2C_TIMEOUT calls fails and the bus is recovered. Needs to
+ * be called from the main loop (see main_dist.c), each call completes the
+ * oldest transaction and starts the next one at most.
+ */
+void I2C_checkQueue(void);
+
+/**
+ * Waits until all queued transactions are completed. The blocking functions
+ * below call it first to keep their order with queued transactions.
+ */
+void I2C_flush(void);
+#endif
+
 /**
  * Read one byte from a one byte register.
  * 
@@ -61,6 +175,17 @@ inline uint8_t I2C_readRegister2(uint8_t address, uint8_t regHigh, uint8_t regLo
  */
 inline uint8_t I2C_readRegister16(uint8_t address, uint16_t reg);
 
+/**
+ * Sequentially read a block of bytes starting at a word register, e.g. from
+ * a 24LCxx EEPROM. Only one address phase is issued for the whole block.
+ * 
+ * @param address I2C device's address.
+ * @param reg Starting register.
+ * @param len Number of bytes to read.
+ * @param buf Buffer of at least len bytes.
+ */
+inline void I2C_readBlock16(uint8_t address, uint16_t reg, uint8_t len, uint8_t *buf);
+
 /**
  * Write one byte to an I2C device.
  * 
@@ -96,6 +221,18 @@ inline void I2C_writeRegister2(uint8_t address, uint8_t regHigh, uint8_t regLow,
  */
 inline void I2C_writeRegister16(uint8_t address, uint16_t reg, uint8_t byte);
 
+/**
+ * Write a block of bytes starting at a word register of an EEPROM using page
+ * writes. The block is split on I2C_PAGE_SIZE boundaries and completion of
+ * each page write is detected by ACK polling.
+ * 
+ * @param address I2C device's address.
+ * @param reg Starting register.
+ * @param len Number of bytes to write.
+ * @param data Data to write.
+ */
+inline void I2C_writePage16(uint8_t address, uint16_t reg, uint8_t len, uint8_t *data);
+
 /**
  * Writes data to an I2C device.
  * 
@@ -30,8 +30,19 @@ void LCD_send(uint8_t command, uint8_t mode) {
     data[2] = nibbleLower | LCD_backlight | En | mode;
     data[3] = nibbleLower | LCD_backlight | mode;
 
+#ifdef I2C_QUEUE_SIZE
+    // Do not wait for the transfer, the data are copied to the queue. The
+    // next queued transfer takes longer than a command executes (37 us), only
+    // clear display and return home (1.52 ms) need to wait.
+    while (!I2C_submit(LCD_ADDRESS, 4, data, 0, NULL, NULL)) I2C_checkQueue();
+    if (mode == 0 && command <= (LCD_RETURNHOME | LCD_CLEARDISPLAY)) {
+        I2C_flush();
+        __delay_ms(2);
+    }
+#else
     I2C_writeData(LCD_ADDRESS, 4, data);
     __delay_ms(2);
+#endif
 }
 
 void LCD_init(void) {
@@ -7,11 +7,25 @@
 
 #ifdef SM_MEM_ADDRESS
 
-uint8_t SM_checkCounter = SM_CHECK_INTERVAL / TIMER_PERIOD;
+#ifdef SM_CHECK_IDLE_INTERVAL
+#define SM_CHECK_PERIOD (SM_CHECK_IDLE_INTERVAL / TIMER_PERIOD)
+volatile bool SM_triggered = false; // Input change signaled (e.g. from an ISR)
+#else
+#define SM_CHECK_PERIOD (SM_CHECK_INTERVAL / TIMER_PERIOD)
+#endif
 
-struct {
-    uint8_t count;
-} SM_states = {0};
+uint16_t SM_checkCounter = SM_CHECK_PERIOD;
+
+typedef struct {
+    uint8_t count;   // Number of states.
+    uint16_t table;  // Address of the state address table.
+    uint8_t inputs;  // Number of condition bytes the image is using.
+    uint8_t flags;   // Image format flags (SM_FLAG_*).
+    uint8_t header;  // Extended header length (0 = original format).
+    uint8_t regions; // Number of regions.
+} SM_States_t;
+
+SM_States_t SM_states = {0, SM_MEM_START + 2, SM_LEGACY_STATE_SIZE, 0x00, 0, 1};
 
 struct {
     uint8_t id;                // Current state (0xFF state machine did not start yet)
@@ -19,31 +33,586 @@ struct {
     uint8_t io[SM_STATE_SIZE]; // Stable state's data.
 } SM_currentState = {0xFF, SM_MEM_START};
 
-struct {
-    uint16_t start; // Action's starting address.
-    uint16_t count; // Total number of actions.
-} SM_actions = {SM_MEM_START, 0};
+typedef struct {
+    uint16_t start;     // Action's starting address.
+    uint16_t count;     // Total number of actions.
+    uint8_t generation; // Image generation the values were read for.
+} SM_Actions_t;
+
+SM_Actions_t SM_actions = {SM_MEM_START, 0, 0};
+
+uint8_t SM_generation = 0; // Image generation, bumped on every image change.
+
+#define SM_VISITED_SIZE 32 // 256 bits, one per state ID
 
 struct {
     uint8_t target;    // Target state (0xFF no target state)
-    uint8_t index;     // Index on the path.
-    uint8_t path[0xFF];// Goto path for loop detection.
+    uint8_t hops;      // Gotos since last reset (0 = visited states stale).
+#ifndef SM_GOTO_HOP_LIMIT
+    uint8_t visited[SM_VISITED_SIZE]; // Goto targets for loop detection.
+#endif
 } SM_goto = {0xFF, 0};
 
+#ifdef SM_REGION_COUNT
+// SM_currentState and SM_goto hold the current region, the others are saved
+// here while not being evaluated.
+struct {
+    uint8_t id;                      // Current state.
+    uint16_t start;                  // Starting address of current state.
+    uint8_t target;                  // Target state.
+    uint8_t hops;                    // Gotos since last reset.
+#ifndef SM_GOTO_HOP_LIMIT
+    uint8_t visited[SM_VISITED_SIZE]; // Goto targets for loop detection.
+#endif
+} SM_regions[SM_REGION_COUNT];
+
+uint8_t SM_region = 0; // Current region.
+#endif
+
+#ifdef SM_PERSIST_INTERVAL
+#define SM_PERSIST_PERIOD (SM_PERSIST_INTERVAL / TIMER_PERIOD)
+#define SM_PERSIST_DATA (SM_PERSIST_SIZE - 3) // IDs and inputs
+
+struct {
+    uint8_t data[SM_PERSIST_DATA]; // Last persisted IDs and inputs.
+    bool valid;                    // Whether the persisted record is valid.
+    uint16_t countdown;            // Ticks until the next write is allowed.
+} SM_persist = {{0}, false, 0};
+#endif
+
+#ifdef SM_TRACE_SIZE
+struct {
+    SM_TraceEntry_t entries[SM_TRACE_SIZE]; // Ring buffer.
+    uint8_t tail;                    // Oldest entry.
+    uint8_t count;                   // Number of entries.
+    uint8_t dropped;                 // Entries dropped since last read.
+    uint16_t tick;                   // SM_periodicalCheck call count.
+    SM_TraceEntry_t pending;         // Entry of the running evaluation pass.
+} SM_trace = {0};
+#endif
+
+#ifdef SM_CONDITION_OPCODES
+#define SM_HELD_PERIOD (SM_HELD_UNIT / TIMER_PERIOD)
+
+struct {
+    uint16_t stable[SM_STATE_SIZE * 8]; // Units each input bit is unchanged.
+    uint16_t elapsed;                   // Units since the previous check.
+    uint16_t ticks;                     // Ticks of the current unit.
+    bool pending;                       // A held condition is not held yet.
+} SM_held = {{0}, 0, 0, false};
+#endif
+
+#ifdef SM_RAM_IMAGE_SIZE
+struct {
+    uint16_t length;                 // Decoded length (0 = not RAM-resident).
+    uint8_t data[SM_RAM_IMAGE_SIZE]; // Image with pre-resolved action addresses.
+} SM_image = {0};
+#endif
+
+#ifdef SM_INDEX_SIZE
+#define SM_INDEX_BYTES ((SM_INDEX_SIZE + 7) / 8)
+struct {
+    bool valid;                      // Whether the index covers current state.
+    uint16_t start[SM_INDEX_SIZE];   // Starting addresses of evaluations.
+    uint8_t bits[SM_STATE_SIZE * 8][SM_INDEX_BYTES]; // Input bit -> evaluations
+} SM_index = {false};
+#endif
+
+#ifdef SM_ACTION_CACHE_SIZE
+struct {
+    uint16_t id[SM_ACTION_CACHE_SIZE];      // Cached action IDs (0xFFFF = free).
+    uint8_t device[SM_ACTION_CACHE_SIZE];   // Devices.
+    uint8_t length[SM_ACTION_CACHE_SIZE];   // Value lengths.
+    uint8_t value[SM_ACTION_CACHE_SIZE][SM_ACTION_CACHE_VALUE_SIZE]; // Values.
+    bool referenced[SM_ACTION_CACHE_SIZE];  // Clock reference bits.
+    uint8_t hand;                           // Clock hand.
+    uint8_t generation;                     // Image generation of the content.
+} SM_actionCache;
+#endif
+
+#ifdef SM_TIMER_COUNT
+#define SM_TIMER_NONE 0xFF
+// Pending timers ordered by expiration. Each timer keeps only the ticks
+// remaining after the previous one, so a tick decrements just the first one.
+struct {
+    uint8_t id[SM_TIMER_COUNT];     // Timer IDs (SM_TIMER_NONE = free slot).
+    uint8_t flags[SM_TIMER_COUNT];  // Flags (SM_TIMER_FLAG_*).
+    uint32_t delta[SM_TIMER_COUNT]; // Ticks remaining after the previous timer.
+    uint16_t ref[SM_TIMER_COUNT];   // Action to execute on expiry.
+    uint8_t next[SM_TIMER_COUNT];   // Next timer to expire.
+#ifdef SM_REGION_COUNT
+    uint8_t region[SM_TIMER_COUNT]; // Region the timer was started in.
+#endif
+    uint8_t head;                   // First timer to expire.
+} SM_timers;
+#endif
+
 Procedure_t SM_EvaluatedHandler;
+Procedure_t SM_CheckedHandler;
 void (*SM_ErrorHandler)(uint8_t);
 
+inline uint8_t SM_read(uint16_t address) {
+#ifdef SM_RAM_IMAGE_SIZE
+    if (SM_image.length > 0) {
+        return (address - SM_MEM_START) < SM_image.length
+                ? SM_image.data[address - SM_MEM_START] : 0xFF;
+    }
+#endif
+    return I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(address));
+}
+
+inline uint16_t SM_read16(uint16_t address) {
+    return (SM_read(address) << 8) | (SM_read(address + 1) & 0xFF);
+}
+
+#ifdef SM_RAM_IMAGE_SIZE
+/**
+ * Copies the image into RAM and replaces action IDs in the evaluation action
+ * lists with the action addresses, so SM_evaluate does not need to look them
+ * up in the action table.
+ */
+void SM_decode(void) {
+    uint16_t length = SM_dataLength();
+    SM_image.length = 0;
+    if (length == 0 || length > SM_RAM_IMAGE_SIZE) return;
+
+    for (uint16_t i = 0; i < length; i++) {
+        SM_image.data[i] = I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(SM_MEM_START + i));
+    }
+
+    uint16_t stateTable = SM_states.table - SM_MEM_START;
+    uint16_t actionTable = SM_actions.start - SM_MEM_START + 2;
+    for (uint8_t s = 0; s < SM_states.count; s++) {
+        uint16_t start = ((SM_image.data[stateTable + s * 2] << 8)
+                | SM_image.data[stateTable + s * 2 + 1]) - SM_MEM_START;
+        if (start >= length) return;
+        uint8_t evaluationCount = SM_image.data[start];
+        uint16_t evaluationStart = start + 1;
+
+        for (uint8_t e = 0; e < evaluationCount; e++) {
+            if (evaluationStart >= length) return;
+            uint16_t actionList = evaluationStart + ((SM_states.flags & SM_FLAG_SPARSE)
+                    ? 1 + SM_image.data[evaluationStart] * 3
+                    : SM_states.inputs * 2);
+            if (actionList >= length) return;
+            uint8_t actionCount = SM_image.data[actionList];
+            if (actionList + actionCount * 2 >= length) return;
+
+            for (uint8_t a = 0; a < actionCount; a++) {
+                uint16_t ref = actionList + a * 2 + 1;
+                uint16_t actionId = (SM_image.data[ref] << 8) | SM_image.data[ref + 1];
+                if (actionId >= SM_actions.count) return;
+                uint16_t entry = actionTable + actionId * 2;
+                SM_image.data[ref] = SM_image.data[entry];
+                SM_image.data[ref + 1] = SM_image.data[entry + 1];
+            }
+            evaluationStart = actionList + actionCount * 2 + 1;
+        }
+    }
+
+    SM_image.length = length;
+}
+#endif
+
+/**
+ * Parses the image format, the state count, the actions start address and the
+ * action count from the header without touching the interpreter's state.
+ * The outputs are written only if every check passes.
+ * 
+ * @param states Image format and state table to fill.
+ * @param actions Action table to fill.
+ * @return Whether the header is valid.
+ */
+bool SM_parseHeader(SM_States_t *states, SM_Actions_t *actions) {
+    SM_States_t parsed;
+    SM_Actions_t table;
+    uint16_t address = SM_MEM_START + 1;
+    parsed.inputs = SM_LEGACY_STATE_SIZE;
+    parsed.flags = 0x00;
+    parsed.header = 0;
+    parsed.regions = 1;
+
+    // 2nd byte: Count of states (0-255) or 0x00 for extended header
+    parsed.count = I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(address));
+    if (parsed.count == 0x00) {
+        uint8_t headerLength = I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(address + 1));
+        if (headerLength < 2) return false;
+        parsed.header = headerLength;
+        parsed.inputs = I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(address + 2));
+        parsed.flags = I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(address + 3));
+        if (headerLength > SM_HEADER_CRC_LENGTH) {
+            uint8_t regions = I2C_readRegister16(SM_MEM_ADDRESS,
+                    SM_ADDRESS(SM_MEM_START + SM_HEADER_REGIONS));
+            if (regions > 1) parsed.regions = regions;
+#ifdef SM_REGION_COUNT
+            if (parsed.regions > SM_REGION_COUNT) return false;
+#else
+            if (parsed.regions > 1) return false;
+#endif
+            if (headerLength < SM_HEADER_CRC_LENGTH + parsed.regions) return false;
+        }
+        address = address + headerLength + 2;
+        parsed.count = I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(address));
+    }
+    if (parsed.inputs == 0 || parsed.inputs > SM_STATE_SIZE) return false;
+#ifdef SM_CONDITION_OPCODES
+    if ((parsed.flags & SM_FLAG_OPCODES) && !(parsed.flags & SM_FLAG_SPARSE)) return false;
+#else
+    if (parsed.flags & SM_FLAG_OPCODES) return false;
+#endif
+
+    parsed.table = address + 1;
+    if (((uint16_t) parsed.count) >= (SM_MAX_SIZE - parsed.table) / 2) {
+        return false;
+    }
+
+    // Start of actions start address.
+    uint16_t actionsStartAddr = parsed.table + ((uint16_t) parsed.count) * 2;
+    if (actionsStartAddr >= SM_MAX_SIZE) return false;
+
+    // Actions start address (2 byte).
+    uint8_t regHigh = I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(actionsStartAddr));
+    uint8_t regLow = I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(actionsStartAddr + 1));
+    table.start = ((regHigh << 8) | regLow);
+    if (table.start >= SM_MAX_SIZE) return false;
+
+    // Number of actions (2 byte).
+    regHigh = I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(table.start));
+    regLow = I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(table.start + 1));
+    table.count = ((regHigh << 8) | regLow);
+    if (table.count >= SM_MAX_SIZE) return false;
+
+    table.generation = SM_generation;
+    *states = parsed; // Only a valid header replaces the previous one
+    *actions = table;
+    return true;
+}
+
+/**
+ * Reads the image format, the state count, the actions start address and the
+ * action count from the header.
+ * 
+ * @return Whether the header is valid.
+ */
+bool SM_loadHeader(void) {
+    return SM_parseHeader(&SM_states, &SM_actions);
+}
+
+/**
+ * Returns the starting address of the action table re-reading the header only
+ * if the image changed since it was last read.
+ * 
+ * @return Actions starting address.
+ */
+inline uint16_t SM_actionsStart(void) {
+    if (SM_actions.generation != SM_generation) SM_loadHeader();
+    return SM_actions.start;
+}
+
+#ifdef SM_REGION_COUNT
+/**
+ * Saves the current region's state and goto context and loads another one's.
+ * 
+ * @param region Region to switch to.
+ */
+void SM_switchRegion(uint8_t region) {
+    if (region == SM_region) return;
+    SM_regions[SM_region].id = SM_currentState.id;
+    SM_regions[SM_region].start = SM_currentState.start;
+    SM_regions[SM_region].target = SM_goto.target;
+    SM_regions[SM_region].hops = SM_goto.hops;
+#ifndef SM_GOTO_HOP_LIMIT
+    if (SM_goto.hops > 0) for (uint8_t i = 0; i < SM_VISITED_SIZE; i++) {
+        SM_regions[SM_region].visited[i] = SM_goto.visited[i];
+    }
+#endif
+
+    SM_region = region;
+    SM_currentState.id = SM_regions[region].id;
+    SM_currentState.start = SM_regions[region].start;
+    SM_goto.target = SM_regions[region].target;
+    SM_goto.hops = SM_regions[region].hops;
+#ifndef SM_GOTO_HOP_LIMIT
+    if (SM_goto.hops > 0) for (uint8_t i = 0; i < SM_VISITED_SIZE; i++) {
+        SM_goto.visited[i] = SM_regions[region].visited[i];
+    }
+#endif
+}
+#endif
+
+#ifdef SM_TRACE_SIZE
+/**
+ * Starts the trace entry of an evaluation pass.
+ * 
+ * @param enteringState Whether the current state is being entered.
+ * @param newState New input state.
+ */
+void SM_traceStart(bool enteringState, uint8_t *newState) {
+    uint8_t hash = 0x00;
+    for (uint8_t c = 0; c < SM_STATE_SIZE; c++) {
+        hash = ((hash << 1) | (hash >> 7)) ^ *(newState + c);
+    }
+    SM_trace.pending.tick = SM_trace.tick;
+    SM_trace.pending.state = SM_currentState.id;
+    SM_trace.pending.target = 0xFF;
+    SM_trace.pending.evaluation = 0xFF;
+    SM_trace.pending.inputs = hash;
+    SM_trace.pending.actions = enteringState ? SM_TRACE_ENTERING : 0x00;
+}
+
+/**
+ * Adds the trace entry of the finished evaluation pass to the trace.
+ * 
+ * @param gotoState Goto target of the pass.
+ */
+void SM_traceFinish(uint8_t gotoState) {
+    SM_trace.pending.target = gotoState;
+    if (SM_trace.count == SM_TRACE_SIZE) { // Drop the oldest
+        SM_trace.tail = (SM_trace.tail + 1) % SM_TRACE_SIZE;
+        SM_trace.count--;
+        if (SM_trace.dropped < 0xFF) SM_trace.dropped++;
+    }
+    SM_trace.entries[(SM_trace.tail + SM_trace.count) % SM_TRACE_SIZE] = SM_trace.pending;
+    SM_trace.count++;
+}
+
+bool SM_tracePeek(uint8_t index, SM_TraceEntry_t *entry) {
+    if (index >= SM_trace.count) return false;
+    *entry = SM_trace.entries[(SM_trace.tail + index) % SM_TRACE_SIZE];
+    return true;
+}
+
+void SM_traceRemove(uint8_t count) {
+    if (count > SM_trace.count) count = SM_trace.count;
+    SM_trace.tail = (SM_trace.tail + count) % SM_TRACE_SIZE;
+    SM_trace.count -= count;
+    SM_trace.dropped = 0;
+}
+
+uint8_t SM_traceCount(void) {
+    return SM_trace.count;
+}
+
+uint8_t SM_traceDropped(void) {
+    return SM_trace.dropped;
+}
+#endif
+
+#ifdef SM_TIMER_COUNT
+/**
+ * Cancels pending timers (of the current region).
+ * 
+ * @param id Timer ID or SM_TIMER_ALL.
+ * @param keep Whether to keep timers with the SM_TIMER_FLAG_KEEP flag.
+ */
+void SM_cancelTimers(uint8_t id, bool keep) {
+    uint8_t previous = SM_TIMER_NONE;
+    uint8_t t = SM_timers.head;
+    while (t != SM_TIMER_NONE) {
+        uint8_t next = SM_timers.next[t];
+        if ((id == SM_TIMER_ALL || id == SM_timers.id[t])
+#ifdef SM_REGION_COUNT
+                && SM_timers.region[t] == SM_region
+#endif
+                && !(keep && (SM_timers.flags[t] & SM_TIMER_FLAG_KEEP))) {
+            // The next timer takes over the remaining ticks
+            if (next != SM_TIMER_NONE) SM_timers.delta[next] += SM_timers.delta[t];
+            if (previous == SM_TIMER_NONE) SM_timers.head = next;
+            else SM_timers.next[previous] = next;
+            SM_timers.id[t] = SM_TIMER_NONE;
+        } else {
+            previous = t;
+        }
+        t = next;
+    }
+}
+
+/**
+ * Starts (or restarts) a timer.
+ * 
+ * @param id Timer ID.
+ * @param flags Timer flags.
+ * @param ticks Number of ticks until expiration.
+ * @param ref Action to execute on expiry (see SM_loadAction).
+ */
+void SM_startTimer(uint8_t id, uint8_t flags, uint32_t ticks, uint16_t ref) {
+    SM_cancelTimers(id, false);
+    uint8_t slot = SM_TIMER_NONE;
+    for (uint8_t t = 0; t < SM_TIMER_COUNT; t++) {
+        if (SM_timers.id[t] == SM_TIMER_NONE) {
+            slot = t;
+            break;
+        }
+    }
+    if (slot == SM_TIMER_NONE) return; // No free slot
+
+    SM_timers.id[slot] = id;
+    SM_timers.flags[slot] = flags;
+    SM_timers.ref[slot] = ref;
+#ifdef SM_REGION_COUNT
+    SM_timers.region[slot] = SM_region;
+#endif
+
+    uint8_t previous = SM_TIMER_NONE;
+    uint8_t t = SM_timers.head;
+    while (t != SM_TIMER_NONE && SM_timers.delta[t] <= ticks) {
+        ticks -= SM_timers.delta[t];
+        previous = t;
+        t = SM_timers.next[t];
+    }
+    SM_timers.delta[slot] = ticks;
+    SM_timers.next[slot] = t;
+    if (t != SM_TIMER_NONE) SM_timers.delta[t] -= ticks;
+    if (previous == SM_TIMER_NONE) SM_timers.head = slot;
+    else SM_timers.next[previous] = slot;
+}
+
+void SM_clearTimers(void) {
+    for (uint8_t t = 0; t < SM_TIMER_COUNT; t++) SM_timers.id[t] = SM_TIMER_NONE;
+    SM_timers.head = SM_TIMER_NONE;
+}
+#endif
+
 void SM_reset(void) {
+#ifdef SM_TIMER_COUNT
+    SM_clearTimers();
+#endif
+#ifdef SM_RAM_IMAGE_SIZE
+    SM_image.length = 0;
+#endif
+#ifdef SM_INDEX_SIZE
+    SM_index.valid = false;
+#endif
+#ifdef SM_PERSIST_INTERVAL
+    SM_persist.valid = false; // Rewrite the whole record
+#endif
+#ifdef SM_CONDITION_OPCODES
+    SM_held.pending = false;
+#endif
     SM_states.count = 0;
+    SM_states.table = SM_MEM_START + 2;
+    SM_states.inputs = SM_LEGACY_STATE_SIZE;
+    SM_states.flags = 0x00;
+    SM_states.header = 0;
     SM_currentState.id = 0xFF;
     SM_goto.target = 0xFF;
     SM_currentState.start = SM_MEM_START;
+#ifdef SM_REGION_COUNT
+    for (uint8_t r = 0; r < SM_REGION_COUNT; r++) {
+        SM_regions[r].id = 0xFF;
+        SM_regions[r].target = 0xFF;
+        SM_regions[r].start = SM_MEM_START;
+        SM_regions[r].hops = 0;
+    }
+    SM_region = 0;
+    SM_states.regions = 1;
+#endif
     SM_actions.start = 0;
     SM_actions.count = 0;
+    SM_actions.generation = SM_generation - 1; // Stale
+#ifdef SM_ACTION_CACHE_SIZE
+    SM_actionCache.generation = SM_generation - 1; // Stale
+#endif
 }
 
+void SM_invalidate(void) {
+    SM_generation++;
+#ifdef SM_VERIFY
+    SM_status = SM_STATUS_DISABLED; // Until verified again by SM_init
+#endif
+}
+
+#ifdef SM_VERIFY
+bool SM_verify(void) {
+    if (SM_states.count == 0) return false;
+#ifdef SM_REGION_COUNT
+    for (uint8_t r = 1; r < SM_states.regions; r++) {
+        if (SM_read(SM_MEM_START + SM_HEADER_REGIONS + r) >= SM_states.count) return false;
+    }
+#endif
+
+    // Actions
+    uint16_t actionTable = SM_actions.start + 2;
+    if (actionTable > SM_MAX_SIZE) return false;
+    if (SM_actions.count > (SM_MAX_SIZE - actionTable) / 2) return false;
+    for (uint16_t a = 0; a < SM_actions.count; a++) {
+        uint16_t address = SM_read16(actionTable + a * 2);
+        if (address >= SM_MAX_SIZE - 2) return false;
+        uint8_t device = SM_read(address) & 0x7F;
+        uint8_t length = SM_read(address + 1);
+        if (length > SM_VALUE_MAX_SIZE || length > SM_MAX_SIZE - 2 - address) return false;
+        if (device == SM_DEVICE_GOTO) {
+            if (length < 1 || SM_read(address + 2) >= SM_states.count) return false;
+#ifdef SM_TIMER_COUNT
+        } else if (device == SM_DEVICE_TIMER && length >= 6) {
+            if (SM_read16(address + 6) >= SM_actions.count) return false;
+#endif
+        }
+    }
+
+    // States
+    bool sparse = SM_states.flags & SM_FLAG_SPARSE;
+    uint8_t inputMask = (SM_states.flags & SM_FLAG_OPCODES) ? SM_OP_INPUT : 0xFF;
+    for (uint8_t s = 0; s < SM_states.count; s++) {
+        uint16_t address = SM_read16(SM_states.table + ((uint16_t) s) * 2);
+        if (address >= SM_MAX_SIZE) return false;
+        uint8_t evaluationCount = SM_read(address++);
+        for (uint8_t e = 0; e < evaluationCount; e++) {
+            if (address >= SM_MAX_SIZE) return false;
+            uint8_t conditionCount = sparse ? SM_read(address++) : SM_states.inputs;
+#ifdef SM_CONDITION_OPCODES
+            bool held = false; // Expecting a held condition's duration entry
+#endif
+            for (uint8_t k = 0; k < conditionCount; k++) {
+                if (address >= SM_MAX_SIZE - 2) return false;
+                uint8_t index = sparse ? SM_read(address++) : 0;
+                if ((index & inputMask) >= SM_states.inputs) return false;
+#ifdef SM_CONDITION_OPCODES
+                bool isHeld = inputMask == SM_OP_INPUT && (index >> 5) == SM_OP_HELD;
+                if (held && !isHeld) return false;
+                held = isHeld && !held;
+#endif
+                address += 2;
+            }
+#ifdef SM_CONDITION_OPCODES
+            if (held) return false;
+#endif
+            if (address >= SM_MAX_SIZE) return false;
+            uint8_t actionCount = SM_read(address++);
+            if (actionCount > (SM_MAX_SIZE - address) / 2) return false;
+            for (uint8_t a = 0; a < actionCount; a++) {
+                if (SM_read16(address) >= SM_actions.count) return false;
+                address += 2;
+            }
+        }
+    }
+    return true;
+}
+#endif
+
+#ifdef SM_SLOTS
+uint8_t SM_activeSlot(void) {
+    return I2C_readRegister16(SM_MEM_ADDRESS, SM_SLOT_SELECTOR) == SM_SLOT_B
+            ? SM_SLOT_B : SM_SLOT_A;
+}
+
+void SM_selectSlot(uint8_t slot) {
+    SM_slot = slot;
+    SM_invalidate();
+}
+#endif
+
 void SM_init(void) {
+#ifdef SM_SLOTS
+    SM_slot = SM_activeSlot();
+#endif
     SM_currentState.start = SM_MEM_START;
+#ifdef SM_ACTION_CACHE_SIZE
+    SM_actionCache.generation = SM_generation - 1; // Stale
+#endif
+#ifdef SM_TIMER_COUNT
+    SM_clearTimers();
+#endif
 
     // Reset current state.
     for (uint8_t i = 0; i < SM_STATE_SIZE; i++) {
@@ -51,158 +620,463 @@ void SM_init(void) {
     }
 
     // 1st byte: Status (0x00 - Enabled, 0xFF - Disabled)
-    SM_status = I2C_readRegister16(SM_MEM_ADDRESS, SM_MEM_START);
+    SM_status = I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(SM_MEM_START));
     if (SM_status != SM_STATUS_ENABLED) {
         SM_reset();
         return;
     }
 
-    // 2nd byte: Count of states (0-255)
-    SM_states.count = I2C_readRegister16(SM_MEM_ADDRESS, SM_MEM_START + 1);
-    if (((uint16_t) SM_states.count) >= (SM_MAX_SIZE - SM_MEM_START - 2) / 2) {
+#ifdef SM_VERIFY
+#ifdef SM_RAM_IMAGE_SIZE
+    SM_image.length = 0; // Verify the stored image
+#endif
+    if (!SM_loadHeader() || !SM_verify()) {
         SM_reset();
+        SM_status = SM_STATUS_DISABLED;
+        if (SM_ErrorHandler) SM_ErrorHandler(SM_ERROR_INVALID);
         return;
     }
-
-    // Start of actions start address.
-    uint16_t actionsStartAddr = SM_MEM_START + ((uint16_t) SM_states.count) * 2 + 2;
-    if (actionsStartAddr >= SM_MAX_SIZE) {
+#else
+    if (!SM_loadHeader()) {
         SM_reset();
+        SM_status = SM_STATUS_DISABLED; // Unsupported or corrupted header
         return;
     }
+#endif
 
-    // Actions start address (2 byte).
-    uint8_t regHigh = I2C_readRegister16(SM_MEM_ADDRESS, actionsStartAddr);
-    uint8_t regLow = I2C_readRegister16(SM_MEM_ADDRESS, actionsStartAddr + 1);
-    SM_actions.start = ((regHigh << 8) | regLow);
-    if (SM_actions.start >= SM_MAX_SIZE) {
-        SM_reset();
-        return;
+#ifdef SM_REGION_COUNT
+    // Initial states of the other regions entered together with region 0
+    for (uint8_t r = 1; r < SM_states.regions; r++) {
+        SM_regions[r].id = 0xFF;
+        SM_regions[r].target = I2C_readRegister16(SM_MEM_ADDRESS,
+                SM_ADDRESS(SM_MEM_START + SM_HEADER_REGIONS + r));
+        SM_regions[r].start = SM_MEM_START;
+        SM_regions[r].hops = 0;
     }
+#endif
 
-    // Number of actions (2 byte).
-    regHigh = I2C_readRegister16(SM_MEM_ADDRESS, SM_actions.start);
-    regLow = I2C_readRegister16(SM_MEM_ADDRESS, SM_actions.start + 1);
-    SM_actions.count = ((regHigh << 8) | regLow);
-    if (SM_actions.count >= SM_MAX_SIZE) {
-        SM_reset();
-        return;
+#ifdef SM_RAM_IMAGE_SIZE
+    SM_decode();
+#endif
+}
+
+bool SM_isRamResident(void) {
+#ifdef SM_RAM_IMAGE_SIZE
+    return SM_image.length > 0;
+#else
+    return false;
+#endif
+}
+
+#ifdef SM_ACTION_CACHE_SIZE
+void SM_flushActionCache(void) {
+    for (uint8_t i = 0; i < SM_ACTION_CACHE_SIZE; i++) {
+        SM_actionCache.id[i] = 0xFFFF;
+        SM_actionCache.referenced[i] = false;
     }
+    SM_actionCache.hand = 0;
+    SM_actionCache.generation = SM_generation;
 }
+#endif
 
-// FIXME: This is a forced fix of some unknown memory leak
-// When fixed, calls of this function should be replaced with SM_actions.start
-uint16_t getActionStart(void) {
-    SM_states.count = I2C_readRegister16(SM_MEM_ADDRESS, SM_MEM_START + 1);
-    uint16_t actionsStartAddr = SM_MEM_START + ((uint16_t) SM_states.count) * 2 + 2;
-    uint8_t regHigh = I2C_readRegister16(SM_MEM_ADDRESS, actionsStartAddr);
-    uint8_t regLow = I2C_readRegister16(SM_MEM_ADDRESS, actionsStartAddr + 1);
-    SM_actions.start = ((regHigh << 8) | regLow);
-    regHigh = I2C_readRegister16(SM_MEM_ADDRESS, SM_actions.start);
-    regLow = I2C_readRegister16(SM_MEM_ADDRESS, SM_actions.start + 1);
-    SM_actions.count = ((regHigh << 8) | regLow);
-    return SM_actions.start;
+/**
+ * Loads an action's device, value length and value.
+ * 
+ * @param ref Action ID or, in case of a RAM-resident image, action's address.
+ * @param entering Whether only actions flagged for entering a state (0x80)
+ *                 should be loaded.
+ * @param device Output parameter for the device (including the 0x80 flag).
+ * @param length Output parameter for the value length.
+ * @param value Output parameter for the value (max. SM_VALUE_MAX_SIZE).
+ * @return Whether the action was loaded or skipped due to "entering".
+ */
+bool SM_loadAction(uint16_t ref, bool entering, uint8_t *device, uint8_t *length,
+        uint8_t *value) {
+    uint16_t address;
+#ifdef SM_ACTION_CACHE_SIZE
+    bool cacheable = !SM_isRamResident();
+    if (cacheable) {
+        if (SM_actionCache.generation != SM_generation) SM_flushActionCache();
+        for (uint8_t i = 0; i < SM_ACTION_CACHE_SIZE; i++) {
+            if (SM_actionCache.id[i] == ref) {
+                SM_actionCacheHits++;
+                SM_actionCache.referenced[i] = true;
+                *device = SM_actionCache.device[i];
+                if (entering && !(*device & 0x80)) return false;
+                *length = SM_actionCache.length[i];
+                for (uint8_t v = 0; v < *length; v++) {
+                    *(value + v) = SM_actionCache.value[i][v];
+                }
+                return true;
+            }
+        }
+        SM_actionCacheMisses++;
+    }
+#endif
+
+#ifdef SM_RAM_IMAGE_SIZE
+    if (SM_image.length > 0) { // Pre-resolved by SM_decode
+        address = ref;
+    } else
+#endif
+    {
+        address = SM_read16(SM_actionsStart() + ref * 2 + 2);
+    }
+
+    *device = SM_read(address);
+    if (entering && !(*device & 0x80)) return false;
+    *length = SM_read(address + 1);
+    for (uint8_t v = 0; v < *length; v++) {
+        if (SM_RANGE_CHECK(v >= SM_VALUE_MAX_SIZE)) break;
+        *(value + v) = SM_read(address + v + 2);
+    }
+
+#ifdef SM_ACTION_CACHE_SIZE
+    if (cacheable && *length <= SM_ACTION_CACHE_VALUE_SIZE) {
+        // Clock replacement: skip recently referenced slots
+        while (SM_actionCache.referenced[SM_actionCache.hand]) {
+            SM_actionCache.referenced[SM_actionCache.hand] = false;
+            SM_actionCache.hand = (SM_actionCache.hand + 1) % SM_ACTION_CACHE_SIZE;
+        }
+        uint8_t i = SM_actionCache.hand;
+        SM_actionCache.id[i] = ref;
+        SM_actionCache.device[i] = *device;
+        SM_actionCache.length[i] = *length;
+        for (uint8_t v = 0; v < *length; v++) {
+            SM_actionCache.value[i][v] = *(value + v);
+        }
+        SM_actionCache.referenced[i] = true;
+        SM_actionCache.hand = (i + 1) % SM_ACTION_CACHE_SIZE;
+    }
+#endif
+    return true;
+}
+
+/**
+ * Executes a loaded action. Goto actions are not executed but passed to the
+ * output parameter.
+ * 
+ * @param device Device (without the 0x80 flag).
+ * @param length Value length.
+ * @param value Value.
+ * @param gotoState Output parameter for a goto action's target state.
+ */
+void SM_execute(uint8_t device, uint8_t length, uint8_t *value, uint8_t *gotoState) {
+    if (device == SM_DEVICE_GOTO) {
+        *gotoState = *value;
+#ifdef SM_TIMER_COUNT
+    } else if (device == SM_DEVICE_TIMER) {
+        if (length < 6 || *value == SM_TIMER_ALL) return;
+        SM_actionsStart(); // Makes sure the action count is loaded
+        uint16_t ref = (*(value + 4) << 8) | *(value + 5);
+        if (SM_RANGE_CHECK(ref >= SM_actions.count)) return;
+#ifdef SM_RAM_IMAGE_SIZE
+        if (SM_image.length > 0) ref = SM_read16(SM_actions.start + ref * 2 + 2);
+#endif
+        uint32_t ticks = (*(value + 2) << 8) | *(value + 3);
+        if (*(value + 1) & SM_TIMER_FLAG_SECONDS) ticks = ticks * 1000;
+        SM_startTimer(*value, *(value + 1), (ticks + TIMER_PERIOD - 1) / TIMER_PERIOD, ref);
+    } else if (device == SM_DEVICE_TIMER_CANCEL) {
+        SM_cancelTimers(length > 0 ? *value : SM_TIMER_ALL, false);
+#endif
+    } else if (SM_executeAction) {
+        SM_executeAction(device, length, value);
+    }
+}
+
+#ifdef SM_TIMER_COUNT
+/** Advances the timers by one tick executing the expired ones. */
+void SM_tickTimers(void) {
+    if (SM_timers.head == SM_TIMER_NONE) return;
+    if (SM_timers.delta[SM_timers.head] > 0) SM_timers.delta[SM_timers.head]--;
+    while (SM_timers.head != SM_TIMER_NONE && SM_timers.delta[SM_timers.head] == 0) {
+        uint8_t t = SM_timers.head;
+        SM_timers.head = SM_timers.next[t];
+        SM_timers.id[t] = SM_TIMER_NONE;
+#ifdef SM_REGION_COUNT
+        SM_switchRegion(SM_timers.region[t]);
+#endif
+
+        uint8_t device, length, gotoState = 0xFF;
+        uint8_t value[SM_VALUE_MAX_SIZE];
+        if (SM_loadAction(SM_timers.ref[t], false, &device, &length, value)) {
+            SM_execute(device & 0x7F, length, value, &gotoState);
+        }
+#ifdef SM_TRACE_SIZE
+        SM_traceStart(false, SM_currentState.io);
+        SM_trace.pending.actions = 1; // Timer's action
+        SM_traceFinish(gotoState);
+#endif
+        if (gotoState < 0xFF && gotoState != SM_goto.target) {
+            SM_enter(gotoState);
+            if (SM_executeAction) {
+                SM_executeAction(SM_DEVICE_GOTO, 1, &gotoState);
+            }
+        }
+    }
+#ifdef SM_REGION_COUNT
+    SM_switchRegion(0);
+#endif
 }
+#endif
 
 bool SM_changed(uint8_t *newState) {
     for (uint8_t i = 0; i < SM_STATE_SIZE; i++) {
-        if (SM_currentState.io[i] != newState[i]) {
-            SM_goto.index = 0; // Reset GOTO path index = reset loop detection
-            return true;
-        }
+        if (SM_currentState.io[i] != newState[i]) return true;
     }
     return false;
 }
 
 bool SM_enter(uint8_t stateId) {
     if (SM_status == SM_STATUS_ENABLED && stateId != SM_currentState.id) {
-        SM_goto.index = 0; // Reset GOTO path index = reset loop detection
+        SM_goto.hops = 0; // Reset loop detection
         SM_goto.target = stateId;
     }
     return SM_status == SM_STATUS_ENABLED;
 }
 
+#ifdef SM_CONDITION_OPCODES
+/**
+ * Evaluates a held condition: the masked input bits equal the condition and
+ * none of them changed for the duration.
+ * 
+ * @param c Input byte index.
+ * @param cond Condition.
+ * @param mask Mask.
+ * @param duration Duration in SM_HELD_UNIT.
+ * @param newState New input state.
+ * @param changed Output parameter set if the condition got held since the
+ *                previous check.
+ * @return Whether the condition is met.
+ */
+bool SM_conditionHeld(uint8_t c, uint8_t cond, uint8_t mask, uint16_t duration,
+        uint8_t *newState, bool *changed) {
+    uint8_t in = *(newState + c);
+    if ((in & mask) != (cond & mask)) return false;
+    uint16_t stable = 0xFFFF;
+    if ((SM_currentState.io[c] ^ in) & mask) {
+        stable = 0; // Changed now
+    } else for (uint8_t b = 0; b < 8; b++) {
+        if ((mask & (0x01 << b)) && SM_held.stable[c * 8 + b] < stable) {
+            stable = SM_held.stable[c * 8 + b];
+        }
+    }
+    if (stable < duration) {
+        SM_held.pending = true; // Check again
+        return false;
+    }
+    if (stable - SM_held.elapsed < duration) *changed = true; // Held since now
+    return true;
+}
+
+/**
+ * Evaluates one condition with an operator other than SM_OP_EQUAL and
+ * SM_OP_HELD.
+ * 
+ * @param op Operator (SM_OP_*).
+ * @param c Input byte index.
+ * @param cond Condition.
+ * @param mask Mask.
+ * @param newState New input state.
+ * @param changed Output parameter set if the condition's inputs changed.
+ * @return Whether the condition is met.
+ */
+bool SM_condition(uint8_t op, uint8_t c, uint8_t cond, uint8_t mask,
+        uint8_t *newState, bool *changed) {
+    uint8_t old = SM_currentState.io[c];
+    uint8_t in = *(newState + c);
+    if (mask & (old ^ in)) *changed = true;
+    switch (op) {
+        case SM_OP_NOT_EQUAL:
+            return (in & mask) != (cond & mask);
+        case SM_OP_RISE:
+            return (~old & in & mask) > 0;
+        case SM_OP_FALL:
+            return (old & ~in & mask) > 0;
+        case SM_OP_CHANGE:
+            return ((old ^ in) & mask) > 0;
+        case SM_OP_GREATER:
+            return (in & mask) > cond;
+        case SM_OP_LESS:
+            return (in & mask) < cond;
+        default:
+            return false;
+    }
+}
+#endif
+
+/**
+ * Evaluates one evaluation and executes its actions if its conditions are met.
+ * 
+ * @param e Evaluation's index in the current state.
+ * @param evaluationStart Evaluation's starting address.
+ * @param enteringState Whether the current state is being entered.
+ * @param newState New input state.
+ * @param gotoState Output parameter for a goto action's target state.
+ * @return Starting address of the next evaluation.
+ */
+uint16_t SM_evaluateOne(uint8_t e, uint16_t evaluationStart, bool enteringState,
+        uint8_t *newState, uint8_t *gotoState) {
+#if !defined SM_INDEX_SIZE && !defined SM_TRACE_SIZE
+    (void) e; // Only the index and the trace need the evaluation's index
+#endif
+#ifdef SM_EVALUATION_HOOK
+    SM_EVALUATION_HOOK(e); // e.g. counting in tools/sm_simulator.c
+#endif
+    bool hasConditions = false;
+    bool wasChanged = false;
+    bool result = true;
+    bool sparse = SM_states.flags & SM_FLAG_SPARSE;
+    uint8_t conditionCount = sparse ? SM_read(evaluationStart) : SM_states.inputs;
+    uint16_t conditionStart = sparse ? evaluationStart + 1 : evaluationStart;
+
+    for (uint8_t k = 0; k < conditionCount; k++) {
+        uint8_t c = sparse ? SM_read(conditionStart++) : k;
+        uint8_t cond = SM_read(conditionStart);
+        uint8_t mask = SM_read(conditionStart + 1);
+        conditionStart += 2;
+#ifdef SM_CONDITION_OPCODES
+        uint8_t op = SM_OP_EQUAL;
+        uint16_t duration = 0;
+        if (SM_states.flags & SM_FLAG_OPCODES) {
+            op = c >> 5;
+            c = c & SM_OP_INPUT;
+        }
+        if (op == SM_OP_HELD) { // Followed by the duration entry
+            k++;
+            if (SM_RANGE_CHECK(k >= conditionCount)) {
+                result = false;
+                continue;
+            }
+            duration = SM_read16(conditionStart + 1);
+            conditionStart += 3;
+        }
+#endif
+        if (SM_RANGE_CHECK(c >= SM_states.inputs)) { // Out of range input byte never matches
+            result = false;
+            continue;
+        }
+
+#ifdef SM_CONDITION_OPCODES
+        if (op == SM_OP_HELD) {
+            hasConditions = true;
+            result = SM_conditionHeld(c, cond, mask, duration, newState, &wasChanged) && result;
+            continue;
+        }
+        if (op != SM_OP_EQUAL) {
+            hasConditions = true;
+            result = SM_condition(op, c, cond, mask, newState, &wasChanged) && result;
+            continue;
+        }
+#endif
+        if (mask > 0) hasConditions = true;
+        uint8_t changedMask = SM_currentState.io[c] ^ *(newState + c);
+        if (mask & changedMask) wasChanged = true;
+        result = result && ((cond & mask) == (*(newState + c) & mask));
+#ifdef SM_INDEX_SIZE
+        if (enteringState && SM_index.valid) {
+            for (uint8_t b = 0; b < 8; b++) if (mask & (0x01 << b)) {
+                SM_index.bits[c * 8 + b][e / 8] |= 0x01 << (e % 8);
+            }
+        }
+#endif
+    }
+
+    uint16_t actionListStart = conditionStart;
+    uint8_t actionCount = SM_read(actionListStart);
+
+    if (((hasConditions && wasChanged) || enteringState) && result) {
+        for (uint8_t a = 0; a < actionCount; a++) {
+            uint8_t actionDevice, actionLength;
+            uint8_t actionValue[SM_VALUE_MAX_SIZE];
+
+            if (SM_loadAction(SM_read16(actionListStart + a * 2 + 1),
+                    enteringState && hasConditions,
+                    &actionDevice, &actionLength, actionValue)) {
+                SM_execute(actionDevice & 0x7F, actionLength, actionValue, gotoState);
+#ifdef SM_TRACE_SIZE
+                SM_trace.pending.evaluation = e;
+                if ((SM_trace.pending.actions & 0x7F) < 0x7F) SM_trace.pending.actions++;
+#endif
+            }
+        }
+    }
+
+    return actionListStart + actionCount * 2 + 1;
+}
+
 void SM_evaluate(bool enteringState, uint8_t *newState) {
     if (SM_status != SM_STATUS_ENABLED) return;
+#ifdef SM_TRACE_SIZE
+    SM_traceStart(enteringState, newState);
+#endif
     
-    uint8_t evaluationCount = I2C_readRegister16(SM_MEM_ADDRESS, SM_currentState.start);
+    uint8_t evaluationCount = SM_read(SM_currentState.start);
     uint16_t evaluationStart = SM_currentState.start + 1;
     uint8_t gotoState = 0xFF;
-    
-    for (uint8_t e = 0; e < evaluationCount; e++) {
-        bool hasConditions = false;
-        bool wasChanged = false;
-        bool result = true;
 
+#ifdef SM_INDEX_SIZE
+    if (enteringState) { // (Re)build the index while walking the evaluations
+        SM_index.valid = evaluationCount <= SM_INDEX_SIZE
+                && !(SM_states.flags & SM_FLAG_OPCODES);
+        for (uint8_t i = 0; i < SM_STATE_SIZE * 8; i++) {
+            for (uint8_t j = 0; j < SM_INDEX_BYTES; j++) {
+                SM_index.bits[i][j] = 0x00;
+            }
+        }
+    } else if (SM_index.valid) { // Visit only evaluations affected by the change
+        uint8_t affected[SM_INDEX_BYTES];
+        for (uint8_t j = 0; j < SM_INDEX_BYTES; j++) affected[j] = 0x00;
         for (uint8_t c = 0; c < SM_STATE_SIZE; c++) {
-            uint16_t conditionStart = evaluationStart + c * 2;
-            uint8_t cond = I2C_readRegister16(SM_MEM_ADDRESS, conditionStart);
-            uint8_t mask = I2C_readRegister16(SM_MEM_ADDRESS, conditionStart + 1);
-
-            if (mask > 0) hasConditions = true;
             uint8_t changedMask = SM_currentState.io[c] ^ *(newState + c);
-            if (mask & changedMask) wasChanged = true;
-            result = result && ((cond & mask) == (*(newState + c) & mask));
-        }
-        
-        uint16_t actionListStart = evaluationStart + SM_STATE_SIZE * 2;
-        uint8_t actionCount = I2C_readRegister16(SM_MEM_ADDRESS, actionListStart);
-
-        if (((hasConditions && wasChanged) || enteringState) && result) {
-            for (uint8_t a = 0; a < actionCount; a++) {
-                uint16_t actionId = I2C_readRegister16(SM_MEM_ADDRESS, actionListStart + a * 2 + 1) << 8;
-                actionId = actionId | (I2C_readRegister16(SM_MEM_ADDRESS, actionListStart + a * 2 + 2) & 0xFF);
-
-                uint16_t actionAddrStart = getActionStart() + actionId * 2 + 2;
-                uint16_t actionAddr = I2C_readRegister16(SM_MEM_ADDRESS, actionAddrStart) << 8;
-                actionAddr = actionAddr | (I2C_readRegister16(SM_MEM_ADDRESS, actionAddrStart + 1) & 0xFF);
-
-                uint8_t device = I2C_readRegister16(SM_MEM_ADDRESS, actionAddr);
-                bool includingEnteringState = (device & 0b10000000) == 0b10000000; // 0x80
-                
-                if (!enteringState || !hasConditions || includingEnteringState) {
-                    uint8_t actionDevice = device & 0x7F;
-
-                    uint8_t actionLength = I2C_readRegister16(SM_MEM_ADDRESS, actionAddr + 1);
-                    uint8_t actionValue[SM_VALUE_MAX_SIZE];
-
-                    for (uint8_t v = 0; v < actionLength; v++) {
-                        if (v < SM_VALUE_MAX_SIZE) {
-                            actionValue[v] = I2C_readRegister16(SM_MEM_ADDRESS, actionAddr + v + 2);
-                        }
-                    }
-
-                    if (actionDevice == SM_DEVICE_GOTO) {
-                        gotoState = actionValue[0];
-                    } else if (SM_executeAction) {
-                        SM_executeAction(actionDevice, actionLength, actionValue);
-                    }
+            for (uint8_t b = 0; changedMask > 0; b++, changedMask >>= 1) {
+                if (changedMask & 0x01) for (uint8_t j = 0; j < SM_INDEX_BYTES; j++) {
+                    affected[j] |= SM_index.bits[c * 8 + b][j];
                 }
             }
         }
-
-        evaluationStart = actionListStart + actionCount * 2 + 1;
+        for (uint8_t e = 0; e < evaluationCount; e++) {
+            if (affected[e / 8] & (0x01 << (e % 8))) {
+                SM_evaluateOne(e, SM_index.start[e], false, newState, &gotoState);
+            }
+        }
+        evaluationCount = 0; // Done, skip the sequential walk
     }
-
-    // Update new state as stable state
-    for (uint8_t c = 0; c < SM_STATE_SIZE; c++) {
-        SM_currentState.io[c] = *(newState + c);
+#endif
+    
+    for (uint8_t e = 0; e < evaluationCount; e++) {
+#ifdef SM_INDEX_SIZE
+        if (enteringState && SM_index.valid) SM_index.start[e] = evaluationStart;
+#endif
+        evaluationStart = SM_evaluateOne(e, evaluationStart, enteringState,
+                newState, &gotoState);
     }
+#ifdef SM_TRACE_SIZE
+    SM_traceFinish(gotoState);
+#endif
 
     if (gotoState < 0xFF) {
-        bool loopDetected = gotoState == SM_currentState.id;
-        for (uint8_t i = 0; i < SM_goto.index; i++) {
-            loopDetected = loopDetected || SM_goto.path[i] == gotoState;
-            if (loopDetected) break;
+#ifdef SM_GOTO_HOP_LIMIT
+        bool loopDetected = gotoState == SM_currentState.id
+                || SM_goto.hops >= SM_GOTO_HOP_LIMIT;
+#else
+        if (SM_goto.hops == 0) { // Forget the visited states of the last chain
+            for (uint8_t i = 0; i < SM_VISITED_SIZE; i++) SM_goto.visited[i] = 0x00;
         }
+        bool loopDetected = gotoState == SM_currentState.id
+                || (SM_goto.visited[gotoState >> 3] & (0x01 << (gotoState & 0x07)));
+#endif
         if (loopDetected) {
-            I2C_writeRegister16(SM_MEM_ADDRESS, SM_MEM_START, SM_STATUS_DISABLED);
+            I2C_writeRegister16(SM_MEM_ADDRESS, SM_ADDRESS(SM_MEM_START), SM_STATUS_DISABLED);
             SM_reset();
             if (SM_ErrorHandler) {
                 SM_ErrorHandler(SM_ERROR_LOOP);
             }
         } else {
-            SM_goto.path[SM_goto.index++] = gotoState;
+#ifndef SM_GOTO_HOP_LIMIT
+            SM_goto.visited[gotoState >> 3] |= 0x01 << (gotoState & 0x07);
+#endif
+            SM_goto.hops++;
             SM_goto.target = gotoState;
             if (SM_executeAction) {
                 SM_executeAction(SM_DEVICE_GOTO, 1, &gotoState);
@@ -215,28 +1089,221 @@ void SM_evaluate(bool enteringState, uint8_t *newState) {
     }
 }
 
+void SM_trigger(void) {
+#ifdef SM_CHECK_IDLE_INTERVAL
+    SM_triggered = true;
+#endif
+}
+
+#ifdef SM_CHECK_IDLE_INTERVAL
+/**
+ * Whether a state change is pending in any region.
+ * 
+ * @return Whether a state change is pending.
+ */
+bool SM_pending(void) {
+    if (SM_goto.target != SM_currentState.id) return true;
+#ifdef SM_REGION_COUNT
+    for (uint8_t r = 1; r < SM_states.regions; r++) {
+        if (SM_regions[r].target != SM_regions[r].id) return true;
+    }
+#endif
+    return false;
+}
+#endif
+
+/**
+ * Enters the current region's target state or evaluates its current state if
+ * the inputs changed.
+ * 
+ * @param newState New input state.
+ * @param changed Whether the inputs changed.
+ */
+void SM_checkRegion(uint8_t *newState, bool changed) {
+    if (SM_goto.target != SM_currentState.id) {
+#ifdef SM_TIMER_COUNT
+        SM_cancelTimers(SM_TIMER_ALL, true); // Leaving current state
+#endif
+        SM_currentState.id = SM_goto.target;
+        SM_currentState.start = SM_read16(
+                SM_states.table + ((uint16_t) SM_goto.target) * 2);
+
+        SM_evaluate(true, newState);
+    } else if (changed && SM_currentState.id < 0xFF) {
+        SM_goto.hops = 0; // Reset loop detection
+        SM_evaluate(false, newState);
+    }
+}
+
+#ifdef SM_PERSIST_INTERVAL
+/**
+ * Image identification stored with the persisted state.
+ * 
+ * @return The stored CRC-16 or 0xFFFF if the image has none.
+ */
+uint16_t SM_persistCrc(void) {
+    uint16_t crc;
+    return SM_storedCrc(&crc) ? crc : 0xFFFF;
+}
+
+/**
+ * Collects the current state of each region and the stable input snapshot.
+ * 
+ * @param data Record's IDs and inputs.
+ */
+void SM_persistCollect(uint8_t *data) {
+    *data = SM_currentState.id;
+#ifdef SM_REGION_COUNT
+    for (uint8_t r = 1; r < SM_REGION_COUNT; r++) *(data + r) = SM_regions[r].id;
+#endif
+    for (uint8_t c = 0; c < SM_STATE_SIZE; c++) {
+        *(data + SM_PERSIST_IDS + c) = SM_currentState.io[c];
+    }
+}
+
+/**
+ * Rewrites the persisted record if it changed unless written recently. The
+ * marker is invalidated first and written last, so a reset part-way through
+ * leaves an invalid record instead of a mix of the old and new one.
+ */
+void SM_persistNext(void) {
+    if (SM_persist.countdown > 0) {
+        SM_persist.countdown--;
+        return;
+    }
+    uint8_t data[SM_PERSIST_DATA];
+    SM_persistCollect(data);
+
+    bool changed = !SM_persist.valid;
+    for (uint8_t i = 0; i < SM_PERSIST_DATA; i++) {
+        if (data[i] != SM_persist.data[i]) changed = true;
+    }
+    if (!changed) return;
+
+    uint8_t header[3] = {0xFF, 0xFF, 0xFF};
+    I2C_writePage16(SM_MEM_ADDRESS, SM_PERSIST_ADDRESS, 1, header); // Invalidate
+    I2C_writePage16(SM_MEM_ADDRESS, SM_PERSIST_ADDRESS + 3, SM_PERSIST_DATA, data);
+    if (!SM_persist.valid) { // Image changed
+        uint16_t crc = SM_persistCrc();
+        header[1] = crc >> 8;
+        header[2] = crc & 0xFF;
+        I2C_writePage16(SM_MEM_ADDRESS, SM_PERSIST_ADDRESS + 1, 2, header + 1);
+    }
+    header[0] = SM_PERSIST_VALID;
+    I2C_writePage16(SM_MEM_ADDRESS, SM_PERSIST_ADDRESS, 1, header); // Mark valid
+    for (uint8_t i = 0; i < SM_PERSIST_DATA; i++) SM_persist.data[i] = data[i];
+    SM_persist.valid = true;
+    SM_persist.countdown = SM_PERSIST_PERIOD;
+}
+
+bool SM_resume(void) {
+    if (SM_status != SM_STATUS_ENABLED) return false;
+    if (I2C_readRegister16(SM_MEM_ADDRESS, SM_PERSIST_ADDRESS) != SM_PERSIST_VALID) return false;
+    uint16_t crc = (I2C_readRegister16(SM_MEM_ADDRESS, SM_PERSIST_ADDRESS + 1) << 8)
+            | I2C_readRegister16(SM_MEM_ADDRESS, SM_PERSIST_ADDRESS + 2);
+    if (crc != SM_persistCrc()) return false;
+
+    uint8_t data[SM_PERSIST_DATA];
+    SM_readBlock(SM_PERSIST_ADDRESS + 3, SM_PERSIST_DATA, data);
+    if (data[0] >= SM_states.count) return false;
+#ifdef SM_REGION_COUNT
+    for (uint8_t r = 1; r < SM_states.regions; r++) {
+        if (data[r] < 0xFF && data[r] >= SM_states.count) return false;
+    }
+    for (uint8_t r = 1; r < SM_states.regions; r++) if (data[r] < 0xFF) {
+        SM_regions[r].id = data[r];
+        SM_regions[r].target = data[r];
+        SM_regions[r].start = SM_read16(SM_states.table + ((uint16_t) data[r]) * 2);
+    }
+#endif
+    SM_currentState.id = data[0];
+    SM_currentState.start = SM_read16(SM_states.table + ((uint16_t) data[0]) * 2);
+    SM_goto.target = data[0];
+    SM_goto.hops = 0;
+    for (uint8_t c = 0; c < SM_STATE_SIZE; c++) {
+        SM_currentState.io[c] = data[SM_PERSIST_IDS + c];
+    }
+
+    for (uint8_t i = 0; i < SM_PERSIST_DATA; i++) SM_persist.data[i] = data[i];
+    SM_persist.valid = true;
+    SM_persist.countdown = SM_PERSIST_PERIOD;
+    return true;
+}
+
+void SM_forget(void) {
+    I2C_writeRegister16(SM_MEM_ADDRESS, SM_PERSIST_ADDRESS, 0xFF);
+    SM_persist.valid = false;
+}
+#endif
+
 void SM_periodicalCheck(void) {
+#ifdef SM_TRACE_SIZE
+    SM_trace.tick++;
+#endif
+#ifdef SM_CONDITION_OPCODES
+    if (++SM_held.ticks >= SM_HELD_PERIOD) {
+        SM_held.ticks = 0;
+        for (uint8_t b = 0; b < SM_STATE_SIZE * 8; b++) {
+            if (SM_held.stable[b] < 0xFFFF) SM_held.stable[b]++;
+        }
+        if (SM_held.elapsed < 0xFFFF) SM_held.elapsed++;
+#ifdef SM_CHECK_IDLE_INTERVAL
+        if (SM_held.pending) SM_triggered = true; // Check again once per unit
+#endif
+    }
+#endif
+#ifdef SM_TIMER_COUNT
+    if (SM_status == SM_STATUS_ENABLED) SM_tickTimers();
+#endif
+#ifdef SM_CHECK_IDLE_INTERVAL
+    // Check right away on input change or pending state change
+    if (SM_triggered || SM_pending()) {
+        SM_triggered = false;
+        SM_checkCounter = 0;
+    }
+#endif
     if (SM_checkCounter > 0) {
         SM_checkCounter--;
     } else {
-        SM_checkCounter = SM_CHECK_INTERVAL / TIMER_PERIOD;
+        SM_checkCounter = SM_CHECK_PERIOD;
         if (SM_status == SM_STATUS_ENABLED && SM_getStateTo && (SM_goto.target < 0xFF || SM_currentState.id < 0xFF)) {
             uint8_t newState[SM_STATE_SIZE];
             SM_getStateTo(newState);
+            bool changed = SM_changed(newState);
+#ifdef SM_CONDITION_OPCODES
+            changed = changed || SM_held.pending; // Check held conditions again
+            SM_held.pending = false;
+#endif
 
-            if (SM_goto.target != SM_currentState.id) {
-                SM_currentState.id = SM_goto.target;
-                SM_currentState.start = I2C_readRegister16(SM_MEM_ADDRESS,
-                        SM_MEM_START + ((uint16_t) SM_goto.target) * 2 + 2) << 8;
-                SM_currentState.start |= I2C_readRegister16(SM_MEM_ADDRESS,
-                        SM_MEM_START + ((uint16_t) SM_goto.target) * 2 + 3) & 0xFF;
+#ifdef SM_REGION_COUNT
+            for (uint8_t r = 0; r < SM_states.regions && SM_status == SM_STATUS_ENABLED; r++) {
+                SM_switchRegion(r);
+                SM_checkRegion(newState, changed);
+            }
+            SM_switchRegion(0);
+#else
+            SM_checkRegion(newState, changed);
+#endif
 
-                SM_evaluate(true, newState);
-            } else if (SM_changed(newState)) {
-                SM_evaluate(false, newState);
+            // Update new state as stable state
+            for (uint8_t c = 0; c < SM_STATE_SIZE; c++) {
+#ifdef SM_CONDITION_OPCODES
+                uint8_t changedBits = SM_currentState.io[c] ^ *(newState + c);
+                for (uint8_t b = 0; b < 8; b++) {
+                    if (changedBits & (0x01 << b)) SM_held.stable[c * 8 + b] = 0;
+                }
+#endif
+                SM_currentState.io[c] = *(newState + c);
             }
+#ifdef SM_CONDITION_OPCODES
+            SM_held.elapsed = 0;
+#endif
         }
     }
+#ifdef SM_PERSIST_INTERVAL
+    if (SM_status == SM_STATUS_ENABLED && SM_currentState.id < 0xFF) SM_persistNext();
+#endif
+    if (SM_CheckedHandler) SM_CheckedHandler();
 }
 
 void SM_setStateGetter(SM_StateConsumer_t stateGetter) {
@@ -251,49 +1318,126 @@ void SM_setEvaluatedHandler(Procedure_t evaluatedHandler) {
     SM_EvaluatedHandler = evaluatedHandler;
 }
 
+void SM_setCheckedHandler(Procedure_t checkedHandler) {
+    SM_CheckedHandler = checkedHandler;
+}
+
 void SM_setErrorHandler(Consumer_t errorHandler) {
     SM_ErrorHandler = errorHandler;
 }
 
-uint16_t SM_dataLength(void) {
-    uint8_t regHigh = I2C_readRegister16(SM_MEM_ADDRESS, SM_MEM_START);
-    uint8_t regLow = I2C_readRegister16(SM_MEM_ADDRESS, SM_MEM_START + 1);
-    if (regHigh != SM_STATUS_ENABLED) return 0;
-    if (((uint16_t) regLow) >= (SM_MAX_SIZE - SM_MEM_START - 2) / 2) return 0;
-    uint16_t actionsStartAddr = ((uint16_t) regLow) * 2 + 2;
-    if (actionsStartAddr >= SM_MAX_SIZE) return SM_MAX_SIZE;
-
-    regHigh = I2C_readRegister16(SM_MEM_ADDRESS, actionsStartAddr);
-    regLow = I2C_readRegister16(SM_MEM_ADDRESS, actionsStartAddr + 1);
-    uint16_t actionsAddress = ((regHigh << 8) | regLow);
-    if (actionsAddress >= SM_MAX_SIZE) return 0;
-
-    regHigh = I2C_readRegister16(SM_MEM_ADDRESS, actionsAddress);
-    regLow = I2C_readRegister16(SM_MEM_ADDRESS, actionsAddress + 1);
-    uint16_t actionCount = ((regHigh << 8) | regLow);
-    if (actionCount >= SM_MAX_SIZE) return 0;
+/**
+ * Computes the image length parsing the header into the caller's structures,
+ * so the running interpreter's header is left intact.
+ * 
+ * @param states Image format and state table to fill.
+ * @param actions Action table to fill.
+ * @return Length of the image or 0 if no valid image is stored.
+ */
+uint16_t SM_parseLength(SM_States_t *states, SM_Actions_t *actions) {
+    if (I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(SM_MEM_START)) != SM_STATUS_ENABLED) return 0;
+    if (!SM_parseHeader(states, actions)) return 0;
+
+    uint16_t actionsAddress = actions->start;
+    uint16_t actionCount = actions->count;
     if (actionsAddress >= SM_MAX_SIZE - (actionCount * 2)) return 0;
 
     uint16_t lastActionAddr = actionsAddress + (actionCount * 2);
     if (lastActionAddr >= SM_MAX_SIZE) return 0;
 
-    regHigh = I2C_readRegister16(SM_MEM_ADDRESS, lastActionAddr);
-    regLow = I2C_readRegister16(SM_MEM_ADDRESS, lastActionAddr + 1);
-    if (((regHigh << 8) | regLow) >= SM_MAX_SIZE - 1) return 0;
-    uint16_t lastActionLengthAddr = ((regHigh << 8) | regLow) + 1;
+    uint8_t reg[2];
+    SM_readBlock(SM_ADDRESS(lastActionAddr), 2, reg);
+    if (((reg[0] << 8) | reg[1]) >= SM_MAX_SIZE - 1) return 0;
+    uint16_t lastActionLengthAddr = ((reg[0] << 8) | reg[1]) + 1;
 
-    regHigh = I2C_readRegister16(SM_MEM_ADDRESS, lastActionLengthAddr);
-    if (lastActionLengthAddr >= SM_MAX_SIZE - regHigh - 1) return 0;
-    return lastActionLengthAddr + regHigh + 1;
+    uint8_t lastActionLength = I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(lastActionLengthAddr));
+    if (lastActionLengthAddr >= SM_MAX_SIZE - lastActionLength - 1) return 0;
+    return lastActionLengthAddr + lastActionLength + 1;
+}
+
+uint16_t SM_dataLength(void) {
+    SM_States_t states;
+    SM_Actions_t actions;
+    return SM_parseLength(&states, &actions);
 }
 
 uint8_t SM_checksum(void) {
-    uint16_t address, length = SM_dataLength();
+    uint8_t buffer[SM_SCAN_BLOCK_SIZE];
+    uint16_t address = 0, length = SM_dataLength();
     uint8_t checksum = 0x00;
-    for (address = 0; address < length; address++) {
-        checksum = checksum + I2C_readRegister16(SM_MEM_ADDRESS, SM_MEM_START + address);
+    while (address < length) {
+        uint8_t size = length - address > SM_SCAN_BLOCK_SIZE
+                ? SM_SCAN_BLOCK_SIZE : (uint8_t) (length - address);
+        SM_readBlock(SM_ADDRESS(SM_MEM_START + address), size, buffer);
+        for (uint8_t i = 0; i < size; i++) checksum = checksum + buffer[i];
+        address += size;
     }
     return checksum;
 }
 
+void SM_readBlock(uint16_t address, uint8_t length, uint8_t *buffer) {
+    I2C_readBlock16(SM_MEM_ADDRESS, address, length, buffer);
+}
+
+uint16_t SM_crc16(uint16_t crc, uint8_t byte) {
+    crc = crc ^ (((uint16_t) byte) << 8);
+    for (uint8_t i = 0; i < 8; i++) {
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+void SM_crcStart(SM_Crc_t *crc) {
+    crc->offset = 0;
+    crc->crc = SM_CRC_INIT;
+    crc->count = 0xFF;
+    crc->header = 0;
+}
+
+void SM_crcUpdate(SM_Crc_t *crc, uint8_t byte) {
+    if (crc->offset == 1) crc->count = byte;
+    if (crc->offset == 2) crc->header = byte;
+    if (crc->count == 0x00 && crc->header >= SM_HEADER_CRC_LENGTH
+            && (crc->offset == SM_HEADER_CRC || crc->offset == SM_HEADER_CRC + 1)) {
+        byte = 0x00; // Stored CRC
+    }
+    if (crc->offset > 0) crc->crc = SM_crc16(crc->crc, byte); // Skip status
+    crc->offset++;
+}
+
+bool SM_storedCrc(uint16_t *crc) {
+    SM_States_t states;
+    SM_Actions_t actions;
+    if (SM_parseLength(&states, &actions) == 0) return false;
+    if (states.header < SM_HEADER_CRC_LENGTH) return false;
+    *crc = (I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(SM_MEM_START + SM_HEADER_CRC)) << 8)
+            | I2C_readRegister16(SM_MEM_ADDRESS, SM_ADDRESS(SM_MEM_START + SM_HEADER_CRC + 1));
+    return true;
+}
+
+void SM_scanStart(SM_Crc_t *scan) {
+    SM_crcStart(scan);
+    scan->length = SM_dataLength();
+}
+
+bool SM_scanNext(SM_Crc_t *scan, uint16_t maxLength) {
+    uint8_t buffer[SM_SCAN_BLOCK_SIZE];
+    while (scan->offset < scan->length && maxLength > 0) {
+        uint16_t length = scan->length - scan->offset;
+        if (length > maxLength) length = maxLength;
+        if (length > SM_SCAN_BLOCK_SIZE) length = SM_SCAN_BLOCK_SIZE;
+        SM_readBlock(SM_ADDRESS(SM_MEM_START + scan->offset), (uint8_t) length, buffer);
+        for (uint8_t i = 0; i < (uint8_t) length; i++) SM_crcUpdate(scan, buffer[i]);
+        maxLength -= length;
+    }
+    return scan->offset >= scan->length;
+}
+
+uint16_t SM_scanCrc(void) {
+    SM_Crc_t scan;
+    SM_scanStart(&scan);
+    while (!SM_scanNext(&scan, SM_SCAN_BLOCK_SIZE));
+    return scan.crc;
+}
+
 #endif
\ No newline at end of file
@@ -86,6 +86,54 @@
  * ...
  * // Action x
  * ATx  |ALx  |ADx0 |ADx1 | ... |ADxy |
+ * 
+ * Extended format:
+ * 
+ * A state count of 0x00 (no states) marks an extended header. It is followed
+ * by the header length (HLN, number of header bytes after HLN before the state
+ * count), the number of input bytes the conditions are using (ISZ, max.
+ * SM_STATE_SIZE), format flags (FLG) and, with a header length of at least 4,
+ * the image's CRC-16 (CRH, CRL). Unknown header bytes are skipped.
+ * 
+ * The CRC-16 (CCITT, initial value 0xFFFF) covers the whole image except the
+ * status byte and counts the CRC bytes as 0x00.
+ * With a header length of at least 5 the header continues with the number of
+ * independent regions (RGN, 0 or 1 = one region) followed by the initial
+ * state of each region except the first one (IS1 ... ISr), which starts in
+ * state 0. All regions share the state and action tables, a goto changes the
+ * state of the region whose evaluation executed it.
+ * Without the SM_FLAG_SPARSE flag each evaluation contains ISZ condition/mask
+ * pairs. With the SM_FLAG_SPARSE flag each evaluation starts with the number
+ * of conditions (CN) followed by the input byte index (Ik), the condition and
+ * the mask of each condition with a non-zero mask.
+ * With the SM_FLAG_OPCODES flag (sparse only) the upper 3 bits of Ik select
+ * the condition's operator (SM_OP_*, 0 = equal) and the lower 5 bits the
+ * input byte. A held condition is followed by a duration entry with the same
+ * Iijk and the duration in SM_HELD_UNIT ms in place of the condition and the
+ * mask (DH, DL), both entries are counted in CNij.
+ * 
+ * // Legend
+ * HLN   - header length
+ * ISZ   - input size (number of condition bytes)
+ * FLG   - flags (SM_FLAG_*)
+ * CRH   - CRC-16 high
+ * CRL   - CRC-16 low
+ * RGN   - region count (r + 1)
+ * ISr   - initial state of region r
+ * CNij  - number of conditions in evaluation j for state i
+ * Iijk  - input byte index of condition k in evaluation j for state i
+ * DH/DL - held condition's duration high/low (SM_OP_HELD)
+ * 
+ * // Header
+ * STA  |0x00 |HLN  |ISZ  |FLG  |CRH  |CRL  |RGN  |IS1  | ... |ISr  | ... |STC  |
+ * SSH0 |SSL0 |SSH1 |SSL1 | ... |SSHi |SSLi |
+ * ASH  |ASL  |
+ * 
+ * // Evaluation j of state i (SM_FLAG_SPARSE)
+ * CNij |
+ * Iij0 |Cij0 |Mij0 |Iij1 |Cij1 |Mij1 | ... |Iijk |Cijk |Mijk |
+ * ACij |
+ * AHij0|ALij0|AHij1|ALij1| ... |AHijl|ALijl|
  */
 #ifndef STATE_MACHINE_H
 #define	STATE_MACHINE_H
@@ -106,15 +154,50 @@ extern "C" {
 #ifndef SM_MEM_START
 #define SM_MEM_START 0x0000
 #endif
+// Memory reserved at the end for the persisted state record, which follows
+// the slot selector by default (see SM_PERSIST_INTERVAL)
+#if defined SM_PERSIST_INTERVAL && defined SM_SLOTS && !defined SM_PERSIST_ADDRESS
+#define SM_PERSIST_RESERVED SM_PERSIST_SIZE
+#else
+#define SM_PERSIST_RESERVED 0
+#endif
 #ifndef SM_MAX_SIZE
 #ifdef MEM_SIZE
+#ifdef SM_SLOTS
+#warning "SM: SM_MAX_SIZE defaults to half of MEM_SIZE"
+#define SM_MAX_SIZE (SM_MEM_START + (MEM_SIZE - SM_MEM_START - 1 - SM_PERSIST_RESERVED) / 2)
+#else
 #warning "SM: SM_MAX_SIZE defaults to MEM_SIZE"
 #define SM_MAX_SIZE MEM_SIZE
+#endif
 #else
 #error "SM: At least one of SM_MAX_SIZE or MEM_SIZE must be defined!"
 #endif
 #endif
 
+#ifdef SM_SLOTS
+/*
+ * A/B image slots: slot A occupies SM_MEM_START - SM_MAX_SIZE, slot B the
+ * same amount of memory right after it, followed by the slot selector byte
+ * (0x01 = slot B, anything else = slot A) and the persisted state record if
+ * any. Images are always addressed as if
+ * stored at SM_MEM_START, SM_ADDRESS translates them into the active slot.
+ * An upload goes into the inactive slot and switching over is a single byte
+ * write of the selector.
+ */
+#define SM_SLOT_OFFSET (SM_MAX_SIZE - SM_MEM_START)
+#ifndef SM_SLOT_SELECTOR
+#define SM_SLOT_SELECTOR (SM_MEM_START + 2 * SM_SLOT_OFFSET)
+#endif
+#define SM_SLOT_A 0x00
+#define SM_SLOT_B 0x01
+#define SM_SLOT_ADDRESS(slot, address) ((slot) == SM_SLOT_B \
+        ? (address) + SM_SLOT_OFFSET : (address))
+#define SM_ADDRESS(address) SM_SLOT_ADDRESS(SM_slot, address)
+#else
+#define SM_ADDRESS(address) (address)
+#endif
+
 #ifndef SM_CHECK_INTERVAL
 #error "SM: TIMER_PERIOD needs to be defined"
 #endif
@@ -122,9 +205,176 @@ extern "C" {
 #ifndef TIMER_PERIOD
 #error "SM: TIMER_PERIOD needs to be defined"
 #endif
+
+// Optional event-driven checking (e.g. #define SM_CHECK_IDLE_INTERVAL 2000).
+// When defined, the inputs are checked on the next SM_periodicalCheck call
+// after SM_trigger() was called, e.g. from an interrupt-on-change ISR. The
+// periodical check then only runs every SM_CHECK_IDLE_INTERVAL ms as a safety
+// net instead of every SM_CHECK_INTERVAL ms.
+
+// Optional RAM-resident image (e.g. #define SM_RAM_IMAGE_SIZE 1024). When
+// defined and the uploaded state machine fits, SM_init decodes it once into RAM
+// and SM_evaluate runs without any I2C traffic. Bigger images fall back to
+// reading the EEPROM directly.
+
+// Optional input-bit dependency index (e.g. #define SM_INDEX_SIZE 32). When
+// defined, entering a state indexes which evaluations depend on which input
+// bits, so an input change only visits the evaluations it can affect. States
+// with more than SM_INDEX_SIZE evaluations are evaluated sequentially.
+
+// Optional action cache (e.g. #define SM_ACTION_CACHE_SIZE 8). When defined,
+// decoded actions read from the EEPROM are kept in a fixed number of slots
+// with clock replacement. Only actions with values up to
+// SM_ACTION_CACHE_VALUE_SIZE bytes are cached.
+// Optional timers (e.g. #define SM_TIMER_COUNT 4). When defined, the
+// SM_DEVICE_TIMER action executes another action (e.g. a goto) after a delay
+// and SM_DEVICE_TIMER_CANCEL cancels pending timers. The timers are driven by
+// SM_periodicalCheck, so the delay resolution is TIMER_PERIOD.
+//
+// SM_DEVICE_TIMER value:        ID | FLG | DH | DL | AH | AL
+//   ID     - timer ID (0x00-0xFE), starting a running timer restarts it
+//   FLG    - SM_TIMER_FLAG_*
+//   DH, DL - delay in ms (or seconds with SM_TIMER_FLAG_SECONDS)
+//   AH, AL - action ID to execute on expiry
+// SM_DEVICE_TIMER_CANCEL value: ID (SM_TIMER_ALL or no value cancels all)
+
+// Optional image verification (#define SM_VERIFY). When defined, SM_init
+// verifies the whole image once (state and action addresses, evaluation
+// lengths, action IDs, value lengths and goto targets) and enables only a
+// valid one. SM_evaluate then runs without per-step range checks.
+#ifdef SM_VERIFY
+#define SM_RANGE_CHECK(condition) false // Verified by SM_init
+#else
+#define SM_RANGE_CHECK(condition) (condition)
+#endif
+
+#if defined SM_ACTION_CACHE_SIZE && !defined SM_ACTION_CACHE_VALUE_SIZE
+#warning "SM: Action cache value size defaults to 8"
+#define SM_ACTION_CACHE_VALUE_SIZE 8
+#endif
     
 #define SM_VALUE_MAX_SIZE 0x60
+
+// Number of input bytes (e.g. #define SM_STATE_SIZE 9). Images in the original
+// format always use 5 condition bytes per evaluation.
+#ifndef SM_STATE_SIZE
 #define SM_STATE_SIZE 5
+#endif
+#if SM_STATE_SIZE < 1 || SM_STATE_SIZE > 31
+#error "SM: SM_STATE_SIZE needs to be between 1 and 31"
+#endif
+#define SM_LEGACY_STATE_SIZE 5
+
+// Optional state machine regions (e.g. #define SM_REGION_COUNT 4). When
+// defined, images can declare up to SM_REGION_COUNT independent regions, each
+// with its own current state, goto loop detection and timers, evaluated from
+// one SM_periodicalCheck over the same inputs.
+#ifdef SM_REGION_COUNT
+#ifdef SM_INDEX_SIZE
+#error "SM: SM_INDEX_SIZE cannot be combined with SM_REGION_COUNT"
+#endif
+#endif
+
+// Goto loop detection. By default the goto targets since the last input
+// change are kept in a 32 byte bitset and a goto to an already visited state
+// is treated as a loop. Optional SM_GOTO_HOP_LIMIT (e.g. #define
+// SM_GOTO_HOP_LIMIT 16) keeps only a counter instead (per region) and treats
+// a goto chain longer than the limit as a loop.
+#if defined SM_GOTO_HOP_LIMIT && (SM_GOTO_HOP_LIMIT < 1 || SM_GOTO_HOP_LIMIT > 0xFF)
+#error "SM: SM_GOTO_HOP_LIMIT needs to be between 1 and 255"
+#endif
+
+// Optional persisted state (e.g. #define SM_PERSIST_INTERVAL 5000). When
+// defined, the current state (of each region) and the stable input snapshot
+// are written to a record at SM_PERSIST_ADDRESS after they change, at most
+// once per SM_PERSIST_INTERVAL ms. SM_resume continues in the persisted state
+// after a reset without executing any actions. Pending timers are not
+// persisted.
+//
+// With SM_SLOTS the record defaults to right after the slot selector and is
+// reserved when deriving SM_MAX_SIZE from MEM_SIZE. The record is updated by
+// invalidating MRK first, page-writing the IDs and the snapshot and writing
+// CRH/CRL and MRK last, so a reset in between leaves no valid stale record.
+//
+// Record: MRK|CRH|CRL|ID0[|ID1...]|IO1|IO2|...|IOn
+// - MRK: SM_PERSIST_VALID if the record is valid
+// - CRH/CRL: The image's stored CRC-16 (0xFFFF if none)
+// - IDr: Current state of region r (0xFF = none)
+// - IOk: Stable input snapshot
+#ifdef SM_PERSIST_INTERVAL
+#ifndef SM_PERSIST_ADDRESS
+#ifdef SM_SLOTS
+#define SM_PERSIST_ADDRESS (SM_SLOT_SELECTOR + 1)
+#else
+#error "SM: SM_PERSIST_ADDRESS needs to be defined outside of the image"
+#endif
+#endif
+#define SM_PERSIST_VALID 0xA5
+#ifdef SM_REGION_COUNT
+#define SM_PERSIST_IDS SM_REGION_COUNT
+#else
+#define SM_PERSIST_IDS 1
+#endif
+#define SM_PERSIST_SIZE (3 + SM_PERSIST_IDS + SM_STATE_SIZE)
+#ifdef MEM_SIZE
+#if SM_PERSIST_ADDRESS + SM_PERSIST_SIZE > MEM_SIZE
+#error "SM: SM_PERSIST_ADDRESS record does not fit into MEM_SIZE"
+#endif
+#endif
+#endif
+
+// Optional evaluation trace (e.g. #define SM_TRACE_SIZE 16). When defined,
+// every evaluation pass and expired timer is recorded in a RAM ring buffer of
+// SM_TRACE_SIZE entries, the oldest entries are dropped when full. The entries
+// are read with SM_tracePeek and removed with SM_traceRemove once e.g. sent
+// over the serial communication (MESSAGE_KIND_SM_TRACE).
+#if defined SM_TRACE_SIZE && (SM_TRACE_SIZE < 1 || SM_TRACE_SIZE > 0xFF)
+#error "SM: SM_TRACE_SIZE needs to be between 1 and 255"
+#endif
+
+// Optional condition operators (e.g. #define SM_CONDITION_OPCODES). When
+// defined, images with the SM_FLAG_OPCODES flag can use edge, change,
+// inequality and held-duration conditions besides the masked equality. The
+// input dependency index (SM_INDEX_SIZE) is not used for such images. A held
+// condition tracks for how long each input bit is unchanged (2 bytes of RAM
+// per input bit). While one is not held yet, the inputs are read once per
+// SM_HELD_UNIT ms, also with SM_CHECK_IDLE_INTERVAL.
+#ifdef SM_CONDITION_OPCODES
+#ifndef SM_HELD_UNIT
+#define SM_HELD_UNIT 100 // ms
+#endif
+#if SM_HELD_UNIT < TIMER_PERIOD
+#error "SM: SM_HELD_UNIT needs to be at least TIMER_PERIOD"
+#endif
+#endif
+
+// Image format flags
+#define SM_FLAG_SPARSE 0x01  // Conditions stored only for non-zero masks
+#define SM_FLAG_OPCODES 0x02 // Condition operators in the input byte index
+
+// Condition operators (SM_FLAG_OPCODES), "in" and "old" being the new and the
+// stable input byte
+#define SM_OP_EQUAL 0x00     // (in & mask) == (cond & mask)
+#define SM_OP_NOT_EQUAL 0x01 // (in & mask) != (cond & mask)
+#define SM_OP_RISE 0x02      // A masked bit changed from 0 to 1
+#define SM_OP_FALL 0x03      // A masked bit changed from 1 to 0
+#define SM_OP_CHANGE 0x04    // A masked bit changed
+#define SM_OP_GREATER 0x05   // (in & mask) > cond
+#define SM_OP_LESS 0x06      // (in & mask) < cond
+#define SM_OP_HELD 0x07      // Masked equality unchanged for DH << 8 | DL units
+#define SM_OP_INPUT 0x1F     // Input byte bits of the input byte index
+
+// Extended header
+#define SM_HEADER_CRC 5        // Offset of the CRC-16 in the image
+#define SM_HEADER_CRC_LENGTH 4 // Minimum header length containing the CRC-16
+#define SM_HEADER_REGIONS 7    // Offset of the region count in the image
+
+#define SM_CRC_INIT 0xFFFF
+
+// Number of bytes read at once when scanning the image
+#ifndef SM_SCAN_BLOCK_SIZE
+#define SM_SCAN_BLOCK_SIZE 16
+#endif
 
 // Action value type
 #define SM_ACTION_TYPE_BOOL 0
@@ -136,8 +386,14 @@ extern "C" {
 #define SM_STATUS_ENABLED 0x00
 #define SM_STATUS_DISABLED 0xFF
 
+// Timer flags
+#define SM_TIMER_FLAG_KEEP 0x01    // Keep running when the state changes
+#define SM_TIMER_FLAG_SECONDS 0x02 // Delay in seconds instead of ms
+#define SM_TIMER_ALL 0xFF
+
 // State machine error codes
 #define SM_ERROR_LOOP 0x01
+#define SM_ERROR_INVALID 0x02
 
 // MCP23017        (  39 -    0 + 1 =   40)
 //                 (0x27 - 0x00 + 1 = 0x28)
@@ -169,12 +425,50 @@ extern "C" {
     
 #define SM_DEVICE_GOTO 0x70
 #define SM_DEVICE_ENTER 0x71
+#define SM_DEVICE_TIMER 0x72
+#define SM_DEVICE_TIMER_CANCEL 0x73
 
 #define SM_DEVICE_MAX 0x80
 
 /** Whether the state machine is enabled or not */
 uint8_t SM_status = SM_STATUS_ENABLED;
 
+#ifdef SM_SLOTS
+/** Active image slot (SM_SLOT_A or SM_SLOT_B). */
+uint8_t SM_slot = SM_SLOT_A;
+#endif
+
+#ifdef SM_ACTION_CACHE_SIZE
+/** Number of actions served from the action cache. */
+uint16_t SM_actionCacheHits = 0;
+
+/** Number of actions read from the memory while using the action cache. */
+uint16_t SM_actionCacheMisses = 0;
+#endif
+
+/** Incremental image CRC-16 calculation. */
+typedef struct {
+    uint16_t offset; // Offset of the next byte in the image.
+    uint16_t length; // Image length (scan only).
+    uint16_t crc;    // CRC-16 of the bytes so far.
+    uint8_t count;   // State count byte (0x00 = extended header).
+    uint8_t header;  // Extended header length.
+} SM_Crc_t;
+
+#ifdef SM_TRACE_SIZE
+#define SM_TRACE_ENTERING 0x80 // Trace entry's action count flag
+
+/** One evaluation pass. */
+typedef struct {
+    uint16_t tick;      // SM_periodicalCheck call count.
+    uint8_t state;      // Evaluated state.
+    uint8_t target;     // Goto target (0xFF = none).
+    uint8_t evaluation; // Last evaluation executing actions (0xFF = none).
+    uint8_t inputs;     // Hash of the input vector.
+    uint8_t actions;    // Executed actions, SM_TRACE_ENTERING when entering.
+} SM_TraceEntry_t;
+#endif
+
 typedef void (*SM_StateConsumer_t)(uint8_t* state);
 typedef void (*SM_executeAction_t)(uint8_t, uint8_t, uint8_t*);
 
@@ -209,17 +503,111 @@ void SM_init(void);
  */
 void SM_reset(void);
 
+/**
+ * Marks the stored image as changed. Cached header values are re-read from the
+ * memory before next use. Needs to be called whenever the image is written.
+ */
+void SM_invalidate(void);
+
+#ifdef SM_PERSIST_INTERVAL
+/**
+ * Resumes the persisted state if it belongs to the loaded image. Needs to be
+ * called after SM_init instead of entering the initial state. No actions are
+ * executed, the current state is considered entered.
+ * 
+ * @return Whether a persisted state was resumed.
+ */
+bool SM_resume(void);
+
+/**
+ * Invalidates the persisted state, e.g. after a new image was uploaded.
+ */
+void SM_forget(void);
+#endif
+
+#ifdef SM_TRACE_SIZE
+/**
+ * Reads an entry of the trace without removing it.
+ * 
+ * @param index Entry index, 0 being the oldest entry.
+ * @param entry Output parameter for the entry.
+ * @return Whether the entry exists.
+ */
+bool SM_tracePeek(uint8_t index, SM_TraceEntry_t *entry);
+
+/**
+ * Removes the oldest entries from the trace and resets the dropped entry
+ * count.
+ * 
+ * @param count Number of entries to remove.
+ */
+void SM_traceRemove(uint8_t count);
+
+/**
+ * Number of entries in the trace.
+ * 
+ * @return Entry count.
+ */
+uint8_t SM_traceCount(void);
+
+/**
+ * Number of entries dropped because the trace was full since the last
+ * SM_traceRemove.
+ * 
+ * @return Dropped entry count (saturating at 255).
+ */
+uint8_t SM_traceDropped(void);
+#endif
+
+#ifdef SM_VERIFY
+/**
+ * Verifies that all addresses, lengths and references in the image stay in
+ * range. Needs the header to be loaded.
+ * 
+ * @return Whether the image is valid.
+ */
+bool SM_verify(void);
+#endif
+
+#ifdef SM_SLOTS
+/**
+ * Reads the active image slot from the slot selector.
+ * 
+ * @return SM_SLOT_A or SM_SLOT_B.
+ */
+uint8_t SM_activeSlot(void);
+
+/**
+ * Switches over to another image slot. All following memory reads use the
+ * new slot, SM_init needs to be called before the state machine continues.
+ * The slot selector in the memory is not written, the caller persists it.
+ * 
+ * @param slot SM_SLOT_A or SM_SLOT_B.
+ */
+void SM_selectSlot(uint8_t slot);
+#endif
+
 /**
  * State machine's periodical check should be called in a loop with timer
  * using the TIMER_PERIOD period. It checks the current state, evaluates the
  * state machine's conditions and executes corresponding actions.
  * 
- * The periodical check uses SM_CHECK_INTERVAL to delay consecutive checks.
+ * The periodical check uses SM_CHECK_INTERVAL to delay consecutive checks,
+ * or SM_CHECK_IDLE_INTERVAL if defined (see SM_trigger).
  */
 void SM_periodicalCheck(void);
 
 /**
- * Enter a state.
+ * Signals an input change. The inputs will be checked on the next
+ * SM_periodicalCheck call regardless of the check interval. This function is
+ * safe to be called from an interrupt service routine and has no effect
+ * unless SM_CHECK_IDLE_INTERVAL is defined.
+ */
+void SM_trigger(void);
+
+/**
+ * Enter a state. With regions this changes the state of the first region, the
+ * other regions enter their initial states along with its first state.
  * 
  * @param stateId State's ID.
  * @return Returns true if state was changed.
@@ -247,6 +635,14 @@ void SM_setActionHandler(SM_executeAction_t actionHandler);
  */
 void SM_setEvaluatedHandler(Procedure_t evaluatedHandler);
 
+/**
+ * Defines checked handler which is called at the end of each
+ * SM_periodicalCheck, e.g. to flush outputs buffered by the action handler.
+ * 
+ * @param checkedHandler
+ */
+void SM_setCheckedHandler(Procedure_t checkedHandler);
+
 /**
  * Defines error handler.
  * 
@@ -254,9 +650,18 @@ void SM_setEvaluatedHandler(Procedure_t evaluatedHandler);
  */
 void SM_setErrorHandler(Consumer_t errorHandler);
 
+/**
+ * Whether the state machine is evaluated from a RAM-resident image.
+ * 
+ * @return True if the image was decoded into RAM by SM_init.
+ */
+bool SM_isRamResident(void);
+
 /**
  * Calculates State Machine's data length.
  * 
+ * The length is always calculated from the EEPROM content.
+ * 
  * @return Length in bytes.
  */
 uint16_t SM_dataLength(void);
@@ -264,10 +669,78 @@ uint16_t SM_dataLength(void);
 /**
  * Calculates State Machine's checksum.
  * 
+ * The checksum is always calculated from the EEPROM content.
+ * 
  * @return Checksum.
  */
 uint8_t SM_checksum(void);
 
+/**
+ * Reads a block of the memory in one sequential read.
+ * 
+ * @param address Starting memory address (see SM_ADDRESS for image addresses).
+ * @param length Number of bytes to read.
+ * @param buffer Output buffer.
+ */
+void SM_readBlock(uint16_t address, uint8_t length, uint8_t *buffer);
+
+/**
+ * Updates a CRC-16 (CCITT) with one byte.
+ * 
+ * @param crc CRC so far (SM_CRC_INIT initially).
+ * @param byte Byte.
+ * @return Updated CRC.
+ */
+uint16_t SM_crc16(uint16_t crc, uint8_t byte);
+
+/**
+ * Starts an image CRC calculation.
+ * 
+ * @param crc Calculation to start.
+ */
+void SM_crcStart(SM_Crc_t *crc);
+
+/**
+ * Updates an image CRC calculation with the next image byte. The bytes need
+ * to be passed in order starting at offset 0.
+ * 
+ * @param crc Calculation.
+ * @param byte Image byte at crc->offset.
+ */
+void SM_crcUpdate(SM_Crc_t *crc, uint8_t byte);
+
+/**
+ * Reads the CRC-16 stored in the image header.
+ * 
+ * @param crc Output parameter for the stored CRC.
+ * @return Whether the image contains a stored CRC.
+ */
+bool SM_storedCrc(uint16_t *crc);
+
+/**
+ * Starts a streaming scan calculating the CRC-16 of the stored image.
+ * 
+ * @param scan Scan to start.
+ */
+void SM_scanStart(SM_Crc_t *scan);
+
+/**
+ * Continues a streaming scan reading the EEPROM in blocks of
+ * SM_SCAN_BLOCK_SIZE bytes.
+ * 
+ * @param scan Scan to continue.
+ * @param maxLength Maximum number of bytes to read in this step.
+ * @return Whether the scan is finished (the CRC is in scan->crc).
+ */
+bool SM_scanNext(SM_Crc_t *scan, uint16_t maxLength);
+
+/**
+ * Calculates the CRC-16 of the stored image with a full scan.
+ * 
+ * @return CRC-16.
+ */
+uint16_t SM_scanCrc(void);
+
 #endif
 
 #ifdef	__cplusplus
@@ -0,0 +1,901 @@
+/*
+ * File:   sm_compiler.c
+ * Author: Jan Kubovy &lt;jan@kubovy.eu&gt;
+ *
+ * Host-side state machine compiler producing the EEPROM image described in
+ * modules/state_machine.h.
+ *
+ * Build: cc -std=c99 -o sm_compiler tools/sm_compiler.c
+ * Usage: sm_compiler [-O0] [-f format] [-u ms] [-x] [-o image.bin] machine.sm
+ *
+ *   -O0  Disable optimizations.
+ *   -f   Image format: "legacy" (5 input bytes), "dense" or "sparse"
+ *        (extended header). By default the smallest format is used, or the
+ *        legacy one if not optimizing. Extended images carry their CRC-16.
+ *   -u   SM_HELD_UNIT in ms the device is built with (default 100), used to
+ *        convert held durations.
+ *   -x   Print the image as a HEX dump to stdout.
+ *   -o   Output binary image file.
+ *
+ * Source format (one statement per line, "#" starts a comment):
+ *
+ *   inputs <count>
+ *   action <name> <device> [enter] [<byte>|"<string>"]...
+ *   region
+ *   state <name>
+ *   when <condition>... do <action>...
+ *
+ * - "inputs" sets the number of input bytes (1-31, default 5, SM_STATE_SIZE)
+ *   and needs to precede all "when" statements.
+ * - The first state is the initial state (state 0).
+ * - "region" starts a new concurrent region (SM_REGION_COUNT) with the
+ *   following state as its initial state. A "region" before the first state
+ *   marks the first region. A goto can only target a state of the same
+ *   region. Images with regions use the extended header.
+ * - <device> is a number or one of: mcp23017_out:<0-7>, ws281x:<0-31>,
+ *   lcd_message, lcd_backlight, lcd_reset, lcd_clear, bt_connected,
+ *   bt_trigger, timer_cancel.
+ * - Timer actions have the form:
+ *   action <name> timer [enter] <id> <delay>[ms|s] [keep] <action>
+ *   executing the <action> (e.g. "goto:<state>") after the delay.
+ * - "enter" executes the action also when entering a state (0x80 flag).
+ * - <condition> is "<byte>.<bit>=<0|1>", "<byte>=<value>/<mask>" or "always"
+ *   (no conditions, executed only when entering the state). Conditions on the
+ *   same input byte are combined.
+ * - Condition operators (SM_CONDITION_OPCODES, sparse format only):
+ *   "<byte>.<bit>=rise", "<byte>.<bit>=fall", "<byte>.<bit>=change",
+ *   "<byte>!=<value>/<mask>", "<byte>><value>[/<mask>]",
+ *   "<byte><<value>[/<mask>]" and "<condition>.held=<duration>[ms|s]" with
+ *   <condition> being "<byte>.<bit>=<0|1>" or "<byte>=<value>/<mask>" (the
+ *   condition met and its masked bits unchanged for the duration, in
+ *   SM_HELD_UNIT without a unit), e.g. "0.3=1.held=2s".
+ * - <action> is an action name or "goto:<state>".
+ * - "when" belongs to the last declared state.
+ *
+ * Optimizations:
+ * - States not reachable from the initial states by goto actions are dropped.
+ * - Evaluations with identical condition/mask vectors in one state are merged,
+ *   unless an evaluation in between shares an action device (or a goto) with
+ *   the later one, e.g. "when 0.0=1 do lcd", "when 0.1=1 do on",
+ *   "when 0.0=1 do off" stays as it is.
+ * - Evaluations are reordered so the ones with fewer conditions and actions
+ *   come first. An evaluation is never moved before another one it shares an
+ *   action device with and goto actions keep their relative order, so the
+ *   resulting outputs stay the same.
+ * - Identical actions (including generated goto actions) are stored once.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SMC_MAX_INPUTS 31           // Max. SM_STATE_SIZE
+#define SMC_LEGACY_INPUTS 5         // SM_LEGACY_STATE_SIZE
+#define SMC_VALUE_MAX_SIZE 0x60     // SM_VALUE_MAX_SIZE
+#define SMC_MAX_SIZE 0x8000         // Maximum image size
+#define SMC_MAX_STATES 255          // 0xFF is reserved for "no state"
+#define SMC_MAX_REGIONS 16
+#define SMC_MAX_EVALUATIONS 255
+#define SMC_MAX_REFS 255
+#define SMC_MAX_ACTIONS 1024
+#define SMC_NAME_SIZE 32
+#define SMC_LINE_SIZE 512
+
+#define SMC_DEVICE_GOTO 0x70
+#define SMC_DEVICE_TIMER 0x72
+#define SMC_DEVICE_TIMER_CANCEL 0x73
+#define SMC_TIMER_FLAG_KEEP 0x01
+#define SMC_TIMER_FLAG_SECONDS 0x02
+#define SMC_DEVICE_ENTER_FLAG 0x80
+#define SMC_FLAG_SPARSE 0x01
+#define SMC_HEADER_CRC 5            // SM_HEADER_CRC
+#define SMC_HEADER_LENGTH 4         // SM_HEADER_CRC_LENGTH
+#define SMC_FLAG_OPCODES 0x02
+#define SMC_OP_NOT_EQUAL 0x01
+#define SMC_OP_RISE 0x02
+#define SMC_OP_FALL 0x03
+#define SMC_OP_CHANGE 0x04
+#define SMC_OP_GREATER 0x05
+#define SMC_OP_LESS 0x06
+#define SMC_OP_HELD 0x07
+#define SMC_HELD_UNIT 100           // Default SM_HELD_UNIT in ms
+#define SMC_MAX_OPS 16
+
+typedef enum {
+    SMC_FORMAT_AUTO, SMC_FORMAT_LEGACY, SMC_FORMAT_DENSE, SMC_FORMAT_SPARSE
+} SMC_Format_t;
+
+typedef struct {
+    char name[SMC_NAME_SIZE];
+    uint8_t device;
+    uint8_t length;
+    uint8_t value[SMC_VALUE_MAX_SIZE];
+    int target;             // Timer's action (see SMC_Evaluation_t refs)
+} SMC_Action_t;
+
+typedef struct {
+    uint8_t op;             // SMC_OP_*
+    uint8_t input;
+    uint8_t cond;
+    uint8_t mask;
+    uint16_t duration;      // Held condition's duration in SM_HELD_UNIT
+} SMC_Condition_t;
+
+typedef struct {
+    uint8_t cond[SMC_MAX_INPUTS];
+    uint8_t mask[SMC_MAX_INPUTS];
+    SMC_Condition_t ops[SMC_MAX_OPS]; // Conditions with an operator
+    uint8_t opCount;
+    uint8_t count;
+    int refs[SMC_MAX_REFS]; // Action index or -(state index + 1) for goto
+} SMC_Evaluation_t;
+
+typedef struct {
+    char name[SMC_NAME_SIZE];
+    uint8_t count;
+    SMC_Evaluation_t *evaluations;
+    int region;
+    int id;                 // Final state ID (-1 = unreachable)
+} SMC_State_t;
+
+typedef struct {
+    int line;
+    int inputs;
+    SMC_Action_t actions[SMC_MAX_ACTIONS];
+    int actionCount;
+    SMC_State_t states[SMC_MAX_STATES];
+    int stateCount;
+    int regions[SMC_MAX_REGIONS]; // Initial state of each region
+    int regionCount;
+    bool regionDeclared;
+    // Unresolved goto targets: names collected during parsing
+    char gotos[SMC_MAX_ACTIONS][SMC_NAME_SIZE];
+    int gotoCount;
+} SMC_Source_t;
+
+SMC_Source_t source = {.inputs = SMC_LEGACY_INPUTS, .regionCount = 1};
+long heldUnit = SMC_HELD_UNIT; // SM_HELD_UNIT in ms (-u)
+
+SMC_Action_t image_actions[SMC_MAX_ACTIONS];
+int image_actionCount = 0;
+
+void fail(const char *message, const char *detail) {
+    fprintf(stderr, "sm_compiler:%d: %s%s%s\n", source.line, message,
+            detail ? ": " : "", detail ? detail : "");
+    exit(1);
+}
+
+// Parsing ////////////////////////////////////////////////////////////////////
+
+/** Splits a line into tokens. Quoted strings are returned with the quote. */
+int tokenize(char *line, char **tokens, int max) {
+    int count = 0;
+    char *p = line;
+    while (*p && count < max) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        if (!*p || *p == '#') break;
+        tokens[count++] = p;
+        if (*p == '"') {
+            char *out = ++p;
+            while (*p && *p != '"') {
+                if (*p == '\\' && *(p + 1)) {
+                    p++;
+                    *out++ = *p == 'n' ? '\n' : *p;
+                    p++;
+                } else *out++ = *p++;
+            }
+            if (*p != '"') fail("Unterminated string", NULL);
+            *out = '\0';
+            p++;
+        } else {
+            while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+            if (*p) *p++ = '\0';
+        }
+    }
+    return count;
+}
+
+long number(const char *str) {
+    char *end;
+    long value = strtol(str, &end, 0);
+    if (*str == '\0' || *end != '\0') fail("Invalid number", str);
+    return value;
+}
+
+uint8_t device(const char *str) {
+    struct {
+        const char *name;
+        uint8_t device;
+        uint8_t count;
+    } devices[] = {
+        {"mcp23017_out:", 0x20, 8},
+        {"ws281x:", 0x28, 32},
+        {"lcd_message", 0x50, 0},
+        {"lcd_backlight", 0x51, 0},
+        {"lcd_reset", 0x52, 0},
+        {"lcd_clear", 0x53, 0},
+        {"bt_connected", 0x60, 0},
+        {"bt_trigger", 0x61, 0},
+        {"timer_cancel", SMC_DEVICE_TIMER_CANCEL, 0},
+    };
+    for (unsigned i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+        size_t len = strlen(devices[i].name);
+        if (devices[i].count > 0 && strncmp(str, devices[i].name, len) == 0) {
+            long index = number(str + len);
+            if (index < 0 || index >= devices[i].count) fail("Invalid device index", str);
+            return devices[i].device + index;
+        } else if (devices[i].count == 0 && strcmp(str, devices[i].name) == 0) {
+            return devices[i].device;
+        }
+    }
+    long value = number(str);
+    if (value < 0 || value >= SMC_DEVICE_ENTER_FLAG) fail("Invalid device", str);
+    return value;
+}
+
+int findState(const char *name) {
+    for (int i = 0; i < source.stateCount; i++) {
+        if (strcmp(source.states[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+int findAction(const char *name) {
+    for (int i = 0; i < source.actionCount; i++) {
+        if (strcmp(source.actions[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+/** Action reference, goto targets are resolved after all states are known. */
+int parseRef(const char *token) {
+    if (strncmp(token, "goto:", 5) == 0) {
+        if (source.gotoCount >= SMC_MAX_ACTIONS) fail("Too many goto actions", NULL);
+        strncpy(source.gotos[source.gotoCount], token + 5, SMC_NAME_SIZE - 1);
+        return -(SMC_MAX_STATES + 1 + source.gotoCount++);
+    }
+    int action = findAction(token);
+    if (action < 0) fail("Unknown action", token);
+    return action;
+}
+
+/** Resolves a goto reference to -(state + 1). */
+int resolveGoto(int ref) {
+    if (ref >= -SMC_MAX_STATES) return ref;
+    int index = -ref - SMC_MAX_STATES - 1;
+    int target = findState(source.gotos[index]);
+    if (target < 0) fail("Unknown goto target", source.gotos[index]);
+    return -(target + 1);
+}
+
+void parseTimer(SMC_Action_t *action, char **tokens, int count) {
+    int i = 3;
+    action->device = SMC_DEVICE_TIMER;
+    if (i < count && strcmp(tokens[i], "enter") == 0) {
+        action->device |= SMC_DEVICE_ENTER_FLAG;
+        i++;
+    }
+    if (count - i < 3 || count - i > 4) {
+        fail("Expected: action <name> timer [enter] <id> <delay> [keep] <action>", NULL);
+    }
+    long id = number(tokens[i++]);
+    if (id < 0 || id >= 0xFF) fail("Invalid timer ID", tokens[i - 1]);
+
+    char *unit = tokens[i];
+    while (*unit >= '0' && *unit <= '9') unit++;
+    bool seconds = strcmp(unit, "s") == 0;
+    if (*unit && !seconds && strcmp(unit, "ms") != 0) fail("Invalid delay", tokens[i]);
+    *unit = '\0';
+    long delay = number(tokens[i++]);
+    if (seconds && delay * 1000 <= 0xFFFF) { // Prefer ms resolution
+        seconds = false;
+        delay = delay * 1000;
+    }
+    if (delay > 0xFFFF) fail("Delay too long", NULL);
+
+    uint8_t flags = seconds ? SMC_TIMER_FLAG_SECONDS : 0x00;
+    if (count - i == 2) {
+        if (strcmp(tokens[i++], "keep") != 0) fail("Expected \"keep\"", tokens[i - 1]);
+        flags |= SMC_TIMER_FLAG_KEEP;
+    }
+    action->target = parseRef(tokens[i]);
+    action->length = 6; // ID, flags, delay and action ID (resolved when emitted)
+    action->value[0] = id;
+    action->value[1] = flags;
+    action->value[2] = delay >> 8;
+    action->value[3] = delay & 0xFF;
+}
+
+void parseAction(char **tokens, int count) {
+    if (count < 3) fail("Expected: action <name> <device> [enter] [values]", NULL);
+    if (source.actionCount >= SMC_MAX_ACTIONS) fail("Too many actions", NULL);
+    if (findAction(tokens[1]) >= 0) fail("Duplicate action", tokens[1]);
+    SMC_Action_t *action = &source.actions[source.actionCount++];
+    strncpy(action->name, tokens[1], SMC_NAME_SIZE - 1);
+    action->length = 0;
+    action->target = 0;
+    if (strcmp(tokens[2], "timer") == 0) {
+        parseTimer(action, tokens, count);
+        return;
+    }
+    action->device = device(tokens[2]);
+    for (int i = 3; i < count; i++) {
+        if (i == 3 && strcmp(tokens[i], "enter") == 0) {
+            action->device |= SMC_DEVICE_ENTER_FLAG;
+        } else if (tokens[i][0] == '"') {
+            for (char *c = tokens[i] + 1; *c; c++) {
+                if (action->length >= SMC_VALUE_MAX_SIZE) fail("Value too long", tokens[1]);
+                action->value[action->length++] = (uint8_t) *c;
+            }
+        } else {
+            long value = number(tokens[i]);
+            if (value < 0 || value > 0xFF) fail("Invalid byte", tokens[i]);
+            if (action->length >= SMC_VALUE_MAX_SIZE) fail("Value too long", tokens[1]);
+            action->value[action->length++] = value;
+        }
+    }
+}
+
+void parseInputs(char **tokens, int count) {
+    if (count != 2) fail("Expected: inputs <count>", NULL);
+    for (int s = 0; s < source.stateCount; s++) {
+        if (source.states[s].count > 0) fail("\"inputs\" after \"when\"", NULL);
+    }
+    source.inputs = number(tokens[1]);
+    if (source.inputs < 1 || source.inputs > SMC_MAX_INPUTS) fail("Invalid input count", tokens[1]);
+}
+
+void parseRegion(int count) {
+    if (count != 1) fail("Expected: region", NULL);
+    if (source.stateCount == 0 && !source.regionDeclared) { // The first region
+        source.regionDeclared = true;
+        return;
+    }
+    if (source.regions[source.regionCount - 1] == source.stateCount) fail("Empty region", NULL);
+    if (source.regionCount >= SMC_MAX_REGIONS) fail("Too many regions", NULL);
+    source.regions[source.regionCount++] = source.stateCount;
+}
+
+void parseState(char **tokens, int count) {
+    if (count != 2) fail("Expected: state <name>", NULL);
+    if (source.stateCount >= SMC_MAX_STATES) fail("Too many states", NULL);
+    if (findState(tokens[1]) >= 0) fail("Duplicate state", tokens[1]);
+    SMC_State_t *state = &source.states[source.stateCount++];
+    strncpy(state->name, tokens[1], SMC_NAME_SIZE - 1);
+    state->evaluations = calloc(SMC_MAX_EVALUATIONS, sizeof(SMC_Evaluation_t));
+    state->count = 0;
+    state->region = source.regionCount - 1;
+}
+
+/** Adds a condition with an operator to an evaluation. */
+SMC_Condition_t *addOp(SMC_Evaluation_t *evaluation, uint8_t op, long byte, long cond, long mask) {
+    if (byte < 0 || byte >= source.inputs || cond < 0 || cond > 0xFF
+            || mask < 0 || mask > 0xFF) fail("Invalid condition", NULL);
+    if (evaluation->opCount >= SMC_MAX_OPS) fail("Too many condition operators", NULL);
+    SMC_Condition_t *condition = &evaluation->ops[evaluation->opCount++];
+    condition->op = op;
+    condition->input = byte;
+    condition->cond = cond;
+    condition->mask = mask;
+    condition->duration = 0;
+    return condition;
+}
+
+/** Parses a condition with an operator, returns false for other conditions. */
+bool parseOp(SMC_Evaluation_t *evaluation, char *token) {
+    char *held = strstr(token, ".held=");
+    if (held) { // <byte>.<bit>=<0|1>.held=<duration>[ms|s], <byte>=<value>/<mask>.held=...
+        char *unit = held + 6;
+        while (*unit >= '0' && *unit <= '9') unit++;
+        long factor = strcmp(unit, "s") == 0 ? 1000 : 1;
+        if (*unit && factor == 1 && strcmp(unit, "ms") != 0) fail("Invalid duration", held + 6);
+        bool units = !*unit;
+        *unit = '\0';
+        long duration = number(held + 6);
+        if (!units) duration = (duration * factor + heldUnit - 1) / heldUnit;
+        if (duration > 0xFFFF) fail("Duration too long", NULL);
+
+        *held = '\0';
+        char *eq = strchr(token, '=');
+        if (!eq) fail("Expected: <condition>.held=<duration>", token);
+        *eq = '\0';
+        char *dot = strchr(token, '.');
+        long value, mask;
+        if (dot) { // <byte>.<bit>=<0|1>
+            *dot = '\0';
+            long bit = number(dot + 1);
+            value = number(eq + 1);
+            if (bit < 0 || bit > 7 || value < 0 || value > 1) fail("Invalid condition", token);
+            mask = 1 << bit;
+            value = value ? mask : 0;
+        } else { // <byte>=<value>/<mask>
+            char *slash = strchr(eq + 1, '/');
+            if (!slash) fail("Invalid condition", token);
+            *slash = '\0';
+            value = number(eq + 1);
+            mask = number(slash + 1);
+        }
+        addOp(evaluation, SMC_OP_HELD, number(token), value & mask, mask)->duration = duration;
+        return true;
+    }
+    char *op = strpbrk(token, "!<>");
+    if (op) { // <byte>!=<value>/<mask>, <byte>><value>[/<mask>], <byte><<value>[/<mask>]
+        uint8_t code = *op == '!' ? SMC_OP_NOT_EQUAL : *op == '>' ? SMC_OP_GREATER : SMC_OP_LESS;
+        if (*op == '!' && *(op + 1) != '=') fail("Invalid condition", token);
+        char *value = op + (*op == '!' ? 2 : 1);
+        *op = '\0';
+        char *slash = strchr(value, '/');
+        if (code == SMC_OP_NOT_EQUAL && !slash) fail("Invalid condition", token);
+        if (slash) *slash = '\0';
+        addOp(evaluation, code, number(token), number(value), slash ? number(slash + 1) : 0xFF);
+        return true;
+    }
+    char *eq = strchr(token, '=');
+    char *dot = strchr(token, '.');
+    if (!eq || !dot || dot > eq) return false;
+    uint8_t code = strcmp(eq + 1, "rise") == 0 ? SMC_OP_RISE
+            : strcmp(eq + 1, "fall") == 0 ? SMC_OP_FALL
+            : strcmp(eq + 1, "change") == 0 ? SMC_OP_CHANGE : 0;
+    if (!code) return false;
+    *eq = '\0';
+    *dot = '\0';
+    long bit = number(dot + 1);
+    if (bit < 0 || bit > 7) fail("Invalid condition", token);
+    addOp(evaluation, code, number(token), 0x00, 1 << bit);
+    return true;
+}
+
+void parseWhen(char **tokens, int count) {
+    if (source.stateCount == 0) fail("\"when\" outside of a state", NULL);
+    SMC_State_t *state = &source.states[source.stateCount - 1];
+    if (state->count >= SMC_MAX_EVALUATIONS) fail("Too many evaluations", state->name);
+    SMC_Evaluation_t *evaluation = &state->evaluations[state->count++];
+    memset(evaluation, 0, sizeof(SMC_Evaluation_t));
+
+    int i = 1;
+    for (; i < count && strcmp(tokens[i], "do") != 0; i++) {
+        if (strcmp(tokens[i], "always") == 0) continue;
+        if (parseOp(evaluation, tokens[i])) continue;
+        char *eq = strchr(tokens[i], '=');
+        if (!eq) fail("Invalid condition", tokens[i]);
+        *eq = '\0';
+        char *dot = strchr(tokens[i], '.');
+        if (dot) { // <byte>.<bit>=<0|1>
+            *dot = '\0';
+            long byte = number(tokens[i]), bit = number(dot + 1), value = number(eq + 1);
+            if (byte < 0 || byte >= source.inputs || bit < 0 || bit > 7
+                    || value < 0 || value > 1) fail("Invalid condition", tokens[i]);
+            evaluation->mask[byte] |= 1 << bit;
+            if (value) evaluation->cond[byte] |= 1 << bit;
+            else evaluation->cond[byte] &= ~(1 << bit);
+        } else { // <byte>=<value>/<mask>
+            char *slash = strchr(eq + 1, '/');
+            if (!slash) fail("Invalid condition", tokens[i]);
+            *slash = '\0';
+            long byte = number(tokens[i]), value = number(eq + 1), mask = number(slash + 1);
+            if (byte < 0 || byte >= source.inputs || value < 0 || value > 0xFF
+                    || mask < 0 || mask > 0xFF) fail("Invalid condition", tokens[i]);
+            evaluation->cond[byte] = (evaluation->cond[byte] & ~mask) | (value & mask);
+            evaluation->mask[byte] |= mask;
+        }
+    }
+    if (i >= count) fail("Expected: when <conditions> do <actions>", NULL);
+
+    for (i++; i < count; i++) {
+        if (evaluation->count >= SMC_MAX_REFS) fail("Too many actions in evaluation", NULL);
+        evaluation->refs[evaluation->count++] = parseRef(tokens[i]);
+    }
+}
+
+void parse(FILE *file) {
+    char line[SMC_LINE_SIZE];
+    char *tokens[SMC_LINE_SIZE / 2];
+    while (fgets(line, sizeof(line), file)) {
+        source.line++;
+        int count = tokenize(line, tokens, SMC_LINE_SIZE / 2);
+        if (count == 0) continue;
+        if (strcmp(tokens[0], "inputs") == 0) parseInputs(tokens, count);
+        else if (strcmp(tokens[0], "action") == 0) parseAction(tokens, count);
+        else if (strcmp(tokens[0], "region") == 0) parseRegion(count);
+        else if (strcmp(tokens[0], "state") == 0) parseState(tokens, count);
+        else if (strcmp(tokens[0], "when") == 0) parseWhen(tokens, count);
+        else fail("Unknown statement", tokens[0]);
+    }
+    source.line = 0;
+    if (source.stateCount == 0) fail("No state defined", NULL);
+    if (source.regions[source.regionCount - 1] == source.stateCount) fail("Empty region", NULL);
+
+    for (int s = 0; s < source.stateCount; s++) {
+        for (int e = 0; e < source.states[s].count; e++) {
+            SMC_Evaluation_t *evaluation = &source.states[s].evaluations[e];
+            for (int r = 0; r < evaluation->count; r++) {
+                evaluation->refs[r] = resolveGoto(evaluation->refs[r]);
+            }
+        }
+    }
+    for (int a = 0; a < source.actionCount; a++) {
+        source.actions[a].target = resolveGoto(source.actions[a].target);
+    }
+}
+
+// Optimizations //////////////////////////////////////////////////////////////
+
+bool isTimer(int ref) {
+    return ref >= 0 && (source.actions[ref].device & ~SMC_DEVICE_ENTER_FLAG) == SMC_DEVICE_TIMER;
+}
+
+/** Fails on a goto (also through timers) to a state of another region. */
+void checkRegions(void) {
+    for (int s = 0; s < source.stateCount; s++) {
+        SMC_State_t *state = &source.states[s];
+        for (int e = 0; e < state->count; e++) {
+            for (int r = 0; r < state->evaluations[e].count; r++) {
+                int ref = state->evaluations[e].refs[r];
+                while (isTimer(ref)) ref = source.actions[ref].target;
+                if (ref < 0 && source.states[-ref - 1].region != state->region) {
+                    fail("Goto to another region", source.states[-ref - 1].name);
+                }
+            }
+        }
+    }
+}
+
+/** Assigns final IDs to states reachable from the initial states. */
+int reachability(bool optimize) {
+    int queue[SMC_MAX_STATES], head = 0, tail = 0, next = 0;
+    for (int s = 0; s < source.stateCount; s++) source.states[s].id = optimize ? -1 : s;
+    if (!optimize) return source.stateCount;
+
+    for (int r = 0; r < source.regionCount; r++) {
+        source.states[source.regions[r]].id = next++;
+        queue[tail++] = source.regions[r];
+    }
+    while (head < tail) {
+        SMC_State_t *state = &source.states[queue[head++]];
+        for (int e = 0; e < state->count; e++) {
+            for (int r = 0; r < state->evaluations[e].count; r++) {
+                int ref = state->evaluations[e].refs[r];
+                while (isTimer(ref)) ref = source.actions[ref].target;
+                if (ref < 0 && source.states[-ref - 1].id < 0) {
+                    source.states[-ref - 1].id = next++;
+                    queue[tail++] = -ref - 1;
+                }
+            }
+        }
+    }
+    // Keep the original order of the states
+    next = 0;
+    for (int s = 0; s < source.stateCount; s++) {
+        if (source.states[s].id >= 0) source.states[s].id = next++;
+    }
+    return next;
+}
+
+void normalize(SMC_Evaluation_t *evaluation) {
+    for (int c = 0; c < source.inputs; c++) {
+        evaluation->cond[c] &= evaluation->mask[c];
+    }
+}
+
+bool sameConditions(SMC_Evaluation_t *a, SMC_Evaluation_t *b) {
+    return memcmp(a->cond, b->cond, source.inputs) == 0
+            && memcmp(a->mask, b->mask, source.inputs) == 0
+            && a->opCount == b->opCount
+            && memcmp(a->ops, b->ops, a->opCount * sizeof(SMC_Condition_t)) == 0;
+}
+
+/** Number of held conditions, each followed by a duration entry. */
+int heldCount(SMC_Evaluation_t *evaluation) {
+    int result = 0;
+    for (int o = 0; o < evaluation->opCount; o++) {
+        if (evaluation->ops[o].op == SMC_OP_HELD) result++;
+    }
+    return result;
+}
+
+int cost(SMC_Evaluation_t *evaluation) {
+    int result = evaluation->count + evaluation->opCount;
+    for (int c = 0; c < source.inputs; c++) if (evaluation->mask[c]) result++;
+    return result;
+}
+
+/** Device of an action reference. LCD and Bluetooth devices share one group. */
+uint8_t refDevice(int ref) {
+    uint8_t device = ref < 0 ? SMC_DEVICE_GOTO : source.actions[ref].device & ~SMC_DEVICE_ENTER_FLAG;
+    if (device == SMC_DEVICE_TIMER || device == SMC_DEVICE_TIMER_CANCEL) return SMC_DEVICE_GOTO;
+    return device >= 0x50 && device < 0x70 ? device & 0xF0 : device;
+}
+
+/** Whether the two evaluations must keep their relative order. */
+bool dependent(SMC_Evaluation_t *a, SMC_Evaluation_t *b) {
+    for (int i = 0; i < a->count; i++) {
+        for (int j = 0; j < b->count; j++) {
+            if (refDevice(a->refs[i]) == refDevice(b->refs[j])) return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Merges evaluations with identical conditions into the first one unless an
+ * evaluation in between shares an action device with the merged one.
+ */
+void merge(SMC_State_t *state) {
+    for (int e = 0; e < state->count; e++) normalize(&state->evaluations[e]);
+    for (int e = 0; e < state->count; e++) {
+        for (int o = e + 1; o < state->count; o++) {
+            SMC_Evaluation_t *a = &state->evaluations[e];
+            SMC_Evaluation_t *b = &state->evaluations[o];
+            bool movable = true;
+            for (int m = e + 1; m < o && movable; m++) {
+                movable = !dependent(&state->evaluations[m], b);
+            }
+            if (movable && sameConditions(a, b) && a->count + b->count <= SMC_MAX_REFS) {
+                for (int r = 0; r < b->count; r++) a->refs[a->count++] = b->refs[r];
+                memmove(b, b + 1, (state->count - o - 1) * sizeof(SMC_Evaluation_t));
+                state->count--;
+                o--;
+            }
+        }
+    }
+}
+
+/** Stable ordering of evaluations by cost respecting dependencies. */
+void order(SMC_State_t *state) {
+    SMC_Evaluation_t tmp;
+    for (int e = 1; e < state->count; e++) {
+        int position = e;
+        while (position > 0
+                && cost(&state->evaluations[position - 1]) > cost(&state->evaluations[e])
+                && !dependent(&state->evaluations[position - 1], &state->evaluations[e])) {
+            position--;
+        }
+        if (position < e) {
+            tmp = state->evaluations[e];
+            memmove(&state->evaluations[position + 1], &state->evaluations[position],
+                    (e - position) * sizeof(SMC_Evaluation_t));
+            state->evaluations[position] = tmp;
+        }
+    }
+}
+
+/** Returns the final action ID of an action, adding it if not yet present. */
+int imageAction(SMC_Action_t *action, bool optimize) {
+    if (optimize) for (int i = 0; i < image_actionCount; i++) {
+        if (image_actions[i].device == action->device
+                && image_actions[i].length == action->length
+                && memcmp(image_actions[i].value, action->value, action->length) == 0) {
+            return i;
+        }
+    }
+    if (image_actionCount >= SMC_MAX_ACTIONS) fail("Too many actions", NULL);
+    image_actions[image_actionCount] = *action;
+    return image_actionCount++;
+}
+
+int resolved[SMC_MAX_ACTIONS];
+
+int resolve(int ref, bool optimize) {
+    if (isTimer(ref)) { // Timer's action ID
+        int target = resolve(source.actions[ref].target, optimize);
+        source.actions[ref].value[4] = target >> 8;
+        source.actions[ref].value[5] = target & 0xFF;
+    }
+    if (ref >= 0 && !optimize) { // Keep each source action once
+        if (resolved[ref] == 0) resolved[ref] = imageAction(&source.actions[ref], optimize) + 1;
+        return resolved[ref] - 1;
+    }
+    if (ref >= 0) return imageAction(&source.actions[ref], optimize);
+    SMC_Action_t action = {"", SMC_DEVICE_GOTO, 1, {source.states[-ref - 1].id}, 0};
+    return imageAction(&action, optimize);
+}
+
+// Image //////////////////////////////////////////////////////////////////////
+
+/** Whether any reachable evaluation uses condition operators. */
+bool hasOps(void) {
+    for (int s = 0; s < source.stateCount; s++) if (source.states[s].id >= 0) {
+        for (int e = 0; e < source.states[s].count; e++) {
+            if (source.states[s].evaluations[e].opCount > 0) return true;
+        }
+    }
+    return false;
+}
+
+uint8_t image[SMC_MAX_SIZE];
+int imageLength = 0;
+
+void put(uint8_t byte) {
+    if (imageLength < SMC_MAX_SIZE) image[imageLength] = byte;
+    imageLength++; // Checked after the whole image is emitted
+}
+
+void put16(int word) {
+    put(word >> 8);
+    put(word & 0xFF);
+}
+
+void set16(int address, int word) {
+    if (address + 1 >= SMC_MAX_SIZE) return;
+    image[address] = word >> 8;
+    image[address + 1] = word & 0xFF;
+}
+
+uint16_t crc16(void) {
+    uint16_t crc = 0xFFFF; // SM_CRC_INIT, status byte excluded, CRC field as 0
+    for (int i = 1; i < imageLength && i < SMC_MAX_SIZE; i++) {
+        uint8_t byte = (i == SMC_HEADER_CRC || i == SMC_HEADER_CRC + 1) ? 0x00 : image[i];
+        crc ^= byte << 8;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+void emit(int stateCount, bool optimize, SMC_Format_t format) {
+    imageLength = 0;
+    image_actionCount = 0;
+    memset(resolved, 0, sizeof(resolved));
+
+    put(0x00); // SM_STATUS_ENABLED
+    if (format != SMC_FORMAT_LEGACY) { // Extended header
+        put(0x00);
+        put(SMC_HEADER_LENGTH + (source.regionCount > 1 ? source.regionCount : 0));
+        put(source.inputs);
+        put((format == SMC_FORMAT_SPARSE ? SMC_FLAG_SPARSE : 0x00)
+                | (hasOps() ? SMC_FLAG_OPCODES : 0x00));
+        put16(0); // CRC-16
+        if (source.regionCount > 1) {
+            put(source.regionCount);
+            for (int r = 1; r < source.regionCount; r++) {
+                put(source.states[source.regions[r]].id);
+            }
+        }
+    }
+    put(stateCount);
+    int stateTable = imageLength;
+    for (int s = 0; s < stateCount; s++) put16(0);
+    int actionsStart = imageLength;
+    put16(0);
+
+    for (int s = 0; s < source.stateCount; s++) {
+        SMC_State_t *state = &source.states[s];
+        if (state->id < 0) continue;
+        set16(stateTable + state->id * 2, imageLength);
+        put(state->count);
+        for (int e = 0; e < state->count; e++) {
+            SMC_Evaluation_t *evaluation = &state->evaluations[e];
+            if (format == SMC_FORMAT_SPARSE) {
+                int conditions = 0;
+                for (int c = 0; c < source.inputs; c++) if (evaluation->mask[c]) conditions++;
+                put(conditions + evaluation->opCount + heldCount(evaluation));
+            }
+            for (int c = 0; c < source.inputs; c++) {
+                if (format == SMC_FORMAT_SPARSE && !evaluation->mask[c]) continue;
+                if (format == SMC_FORMAT_SPARSE) put(c);
+                put(evaluation->cond[c]);
+                put(evaluation->mask[c]);
+            }
+            for (int o = 0; o < evaluation->opCount; o++) {
+                put(evaluation->ops[o].op << 5 | evaluation->ops[o].input);
+                put(evaluation->ops[o].cond);
+                put(evaluation->ops[o].mask);
+                if (evaluation->ops[o].op == SMC_OP_HELD) { // Duration entry
+                    put(evaluation->ops[o].op << 5 | evaluation->ops[o].input);
+                    put16(evaluation->ops[o].duration);
+                }
+            }
+            put(evaluation->count);
+            for (int r = 0; r < evaluation->count; r++) {
+                put16(resolve(evaluation->refs[r], optimize));
+            }
+        }
+    }
+
+    set16(actionsStart, imageLength);
+    put16(image_actionCount);
+    int actionTable = imageLength;
+    for (int a = 0; a < image_actionCount; a++) put16(0);
+    for (int a = 0; a < image_actionCount; a++) {
+        set16(actionTable + a * 2, imageLength);
+        put(image_actions[a].device);
+        put(image_actions[a].length);
+        for (int v = 0; v < image_actions[a].length; v++) put(image_actions[a].value[v]);
+    }
+    if (format != SMC_FORMAT_LEGACY) set16(SMC_HEADER_CRC, crc16());
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-O0] [-f legacy|dense|sparse] [-u ms] [-x] [-o image.bin] machine.sm\n",
+            program);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    bool optimize = true, hex = false;
+    SMC_Format_t format = SMC_FORMAT_AUTO;
+    const char *output = NULL, *input = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-O0") == 0) optimize = false;
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "legacy") == 0) format = SMC_FORMAT_LEGACY;
+            else if (strcmp(argv[i], "dense") == 0) format = SMC_FORMAT_DENSE;
+            else if (strcmp(argv[i], "sparse") == 0) format = SMC_FORMAT_SPARSE;
+            else usage(argv[0]);
+        }
+        else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            heldUnit = strtol(argv[++i], NULL, 10);
+            if (heldUnit < 1) usage(argv[0]);
+        }
+        else if (strcmp(argv[i], "-x") == 0) hex = true;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+        else if (argv[i][0] != '-' && !input) input = argv[i];
+        else usage(argv[0]);
+    }
+    if (!input) usage(argv[0]);
+
+    FILE *file = fopen(input, "r");
+    if (!file) {
+        perror(input);
+        return 1;
+    }
+    parse(file);
+    fclose(file);
+    checkRegions();
+
+    int evaluationsBefore = 0, evaluationsAfter = 0;
+    for (int s = 0; s < source.stateCount; s++) evaluationsBefore += source.states[s].count;
+    int stateCount = reachability(optimize);
+    for (int s = 0; s < source.stateCount; s++) {
+        if (optimize && source.states[s].id >= 0) {
+            merge(&source.states[s]);
+            order(&source.states[s]);
+        }
+        if (source.states[s].id >= 0) evaluationsAfter += source.states[s].count;
+    }
+    bool legacy = source.inputs == SMC_LEGACY_INPUTS && source.regionCount == 1;
+    if (hasOps() && format != SMC_FORMAT_AUTO && format != SMC_FORMAT_SPARSE) {
+        fail("Condition operators need the sparse format", NULL);
+    } else if (hasOps()) {
+        format = SMC_FORMAT_SPARSE;
+    } else if (format == SMC_FORMAT_LEGACY && source.inputs != SMC_LEGACY_INPUTS) {
+        fail("Legacy format needs 5 inputs", NULL);
+    } else if (format == SMC_FORMAT_LEGACY && !legacy) {
+        fail("Legacy format cannot hold regions", NULL);
+    } else if (format == SMC_FORMAT_AUTO && optimize) { // Smallest format
+        int smallest = SMC_MAX_SIZE + 1;
+        for (SMC_Format_t f = SMC_FORMAT_LEGACY; f <= SMC_FORMAT_SPARSE; f++) {
+            if (f == SMC_FORMAT_LEGACY && !legacy) continue;
+            emit(stateCount, optimize, f);
+            if (imageLength < smallest) {
+                smallest = imageLength;
+                format = f;
+            }
+        }
+    } else if (format == SMC_FORMAT_AUTO) {
+        format = legacy ? SMC_FORMAT_LEGACY : SMC_FORMAT_DENSE;
+    }
+    emit(stateCount, optimize, format);
+    if (imageLength > SMC_MAX_SIZE) fail("Image too big", NULL);
+
+    const char *formats[] = {"auto", "legacy", "dense", "sparse"};
+    fprintf(stderr, "States: %d/%d, evaluations: %d/%d, actions: %d, format: %s, size: %d bytes\n",
+            stateCount, source.stateCount, evaluationsAfter, evaluationsBefore,
+            image_actionCount, formats[format], imageLength);
+
+    if (output) {
+        file = fopen(output, "wb");
+        if (!file || fwrite(image, 1, imageLength, file) != (size_t) imageLength) {
+            perror(output);
+            return 1;
+        }
+        fclose(file);
+    }
+    if (hex) for (int i = 0; i < imageLength; i++) {
+        printf("%02X%s", image[i], (i % 16 == 15 || i == imageLength - 1) ? "\n" : " ");
+    }
+    return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * File:   sm_simulator.c
+ * Author: Jan Kubovy &lt;jan@kubovy.eu&gt;
+ *
+ * Host-side simulator running the unmodified State Machine module
+ * (modules/state_machine.c) against a simulated 24LCxx EEPROM holding an
+ * uploaded image.
+ *
+ * Build: cc -std=gnu99 -fgnu89-inline -o sm_simulator tools/sm_simulator.c
+ *        Module options can be added with -D, e.g. -DSM_RAM_IMAGE_SIZE=1024.
+ * Usage: sm_simulator [-q] [-k kHz] image.bin trace.txt
+ *
+ *   -q  Print only the summary.
+ *   -k  I2C bus speed in kHz used to estimate the check duration (default
+ *       400).
+ *
+ * Trace format: one input vector of SM_STATE_SIZE HEX bytes per line, each
+ * applied for one check (tick). "<count>*" prefix repeats the vector, e.g.
+ * "10* 01 00 00 00 00". Empty lines repeat the previous vector, "#" starts
+ * a comment.
+ *
+ * Each tick reports the current state (of each region with SM_REGION_COUNT,
+ * separated by ","), the number of visited evaluations, I2C register reads,
+ * executed actions and goto hops.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Host replacements of lib/requirements.h, config.h and modules/i2c.h
+#define REQUIREMENTS_H
+#define I2C_H
+
+#ifndef SIM_EEPROM_SIZE
+#define SIM_EEPROM_SIZE 0x8000      // 24LC256
+#endif
+#define SIM_EEPROM_ADDRESS 0x50
+// Address phase: START, control, 2 address bytes, repeated START and control
+// (bit clocks)
+#define SIM_ADDRESS_CLOCKS 38
+// One data byte with its ACK (bit clocks)
+#define SIM_BYTE_CLOCKS 9
+
+#define __delay_ms(x) ((void) (x))
+#define __delay_us(x) ((void) (x))
+
+#define TIMER_PERIOD 1
+#ifndef SM_CHECK_INTERVAL
+#define SM_CHECK_INTERVAL 0         // Check every tick
+#endif
+#define SM_MEM_ADDRESS SIM_EEPROM_ADDRESS
+#define MEM_SIZE SIM_EEPROM_SIZE
+#ifndef SM_SLOTS
+#define SM_MAX_SIZE SIM_EEPROM_SIZE // Slots are derived from MEM_SIZE
+#endif
+
+uint8_t I2C_readRegister16(uint8_t address, uint16_t reg);
+void I2C_readBlock16(uint8_t address, uint16_t reg, uint8_t len, uint8_t *buf);
+void I2C_writeRegister16(uint8_t address, uint16_t reg, uint8_t byte);
+void I2C_writePage16(uint8_t address, uint16_t reg, uint8_t len, uint8_t *data);
+
+struct {
+    uint32_t reads;
+    uint32_t clocks;
+    uint32_t writes;
+    uint32_t evaluations;
+    uint32_t actions;
+    uint32_t gotos;
+    uint32_t errors;
+} SIM_tick, SIM_total;
+
+#define SM_EVALUATION_HOOK(e) SIM_tick.evaluations++
+
+#include "../modules/state_machine.c"
+
+uint8_t SIM_eeprom[SIM_EEPROM_SIZE];
+
+uint8_t SIM_input[SM_STATE_SIZE];
+bool SIM_quiet = false;
+
+uint8_t I2C_readRegister16(uint8_t address, uint16_t reg) {
+    SIM_tick.reads++;
+    SIM_tick.clocks += SIM_ADDRESS_CLOCKS + SIM_BYTE_CLOCKS;
+    return address == SIM_EEPROM_ADDRESS ? SIM_eeprom[reg % SIM_EEPROM_SIZE] : 0xFF;
+}
+
+void I2C_readBlock16(uint8_t address, uint16_t reg, uint8_t len, uint8_t *buf) {
+    // Sequential read: one address phase for the whole block
+    if (len > 0) SIM_tick.clocks += SIM_ADDRESS_CLOCKS;
+    for (uint8_t i = 0; i < len; i++) {
+        SIM_tick.reads++;
+        SIM_tick.clocks += SIM_BYTE_CLOCKS;
+        buf[i] = address == SIM_EEPROM_ADDRESS ? SIM_eeprom[(reg + i) % SIM_EEPROM_SIZE] : 0xFF;
+    }
+}
+
+void I2C_writeRegister16(uint8_t address, uint16_t reg, uint8_t byte) {
+    SIM_tick.writes++;
+    if (address == SIM_EEPROM_ADDRESS) SIM_eeprom[reg % SIM_EEPROM_SIZE] = byte;
+}
+
+void I2C_writePage16(uint8_t address, uint16_t reg, uint8_t len, uint8_t *data) {
+    for (uint8_t i = 0; i < len; i++) I2C_writeRegister16(address, reg + i, *(data + i));
+}
+
+void SIM_getState(uint8_t *state) {
+    memcpy(state, SIM_input, SM_STATE_SIZE);
+}
+
+void SIM_executeAction(uint8_t device, uint8_t length, uint8_t *value) {
+    if (device == SM_DEVICE_GOTO) SIM_tick.gotos++;
+    else SIM_tick.actions++;
+    if (!SIM_quiet) {
+        printf(" %02X:", device);
+        for (uint8_t i = 0; i < length; i++) printf("%02X", value[i]);
+    }
+}
+
+void SIM_error(uint8_t error) {
+    SIM_tick.errors++;
+    if (!SIM_quiet) printf(" ERROR:%d", error);
+}
+
+bool SIM_parse(char *line, uint32_t *repeat) {
+    char *p = line;
+    *repeat = 1;
+    char *star = strchr(line, '*');
+    if (star) {
+        *repeat = strtoul(line, NULL, 10);
+        p = star + 1;
+    }
+    char *comment = strchr(p, '#');
+    if (comment) {
+        *comment = '\0';
+        if (strspn(line, " \t") == (size_t) (comment - line)) *repeat = 0;
+    }
+    for (uint8_t i = 0; i < SM_STATE_SIZE; i++) {
+        char *end;
+        unsigned long value = strtoul(p, &end, 16);
+        if (end == p) return i == 0 && !star; // Empty line repeats
+        SIM_input[i] = value;
+        p = end;
+    }
+    return true;
+}
+
+void SIM_run(void) {
+#ifdef SM_CHECK_IDLE_INTERVAL
+    // Interrupt-on-change
+    if (memcmp(SM_currentState.io, SIM_input, SM_STATE_SIZE) != 0) SM_trigger();
+#endif
+    SM_periodicalCheck();
+}
+
+void SIM_printState(void) {
+    printf(" | %u", SM_currentState.id);
+#ifdef SM_REGION_COUNT
+    for (uint8_t r = 1; r < SM_states.regions; r++) printf(",%u", SM_regions[r].id);
+#endif
+}
+
+int main(int argc, char **argv) {
+    const char *imageFile = NULL, *traceFile = NULL;
+    unsigned long kHz = 400;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-q") == 0) SIM_quiet = true;
+        else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) kHz = strtoul(argv[++i], NULL, 10);
+        else if (!imageFile) imageFile = argv[i];
+        else if (!traceFile) traceFile = argv[i];
+    }
+    if (!imageFile || !traceFile || kHz == 0) {
+        fprintf(stderr, "Usage: %s [-q] [-k kHz] image.bin trace.txt\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(imageFile, "rb");
+    if (!file) {
+        perror(imageFile);
+        return 1;
+    }
+    memset(SIM_eeprom, 0xFF, SIM_EEPROM_SIZE);
+    size_t size = fread(SIM_eeprom, 1, SIM_EEPROM_SIZE, file);
+    fclose(file);
+
+    FILE *trace = fopen(traceFile, "r");
+    if (!trace) {
+        perror(traceFile);
+        return 1;
+    }
+
+    SM_setStateGetter(SIM_getState);
+    SM_setActionHandler(SIM_executeAction);
+    SM_setErrorHandler(SIM_error);
+    SM_init();
+    SM_enter(0);
+    uint32_t initReads = SIM_tick.reads;
+    memset(&SIM_tick, 0, sizeof(SIM_tick));
+
+    char line[256];
+    uint32_t tick = 0, repeat, maxReads = 0, maxClocks = 0, maxTick = 0;
+    if (!SIM_quiet) printf("tick state evaluations reads actions gotos\n");
+    while (fgets(line, sizeof(line), trace)) {
+        if (!SIM_parse(line, &repeat)) {
+            fprintf(stderr, "Invalid trace line: %s", line);
+            return 1;
+        }
+        for (uint32_t r = 0; r < repeat; r++, tick++) {
+            if (!SIM_quiet) printf("%u", tick);
+            SIM_run();
+            if (!SIM_quiet) {
+                SIM_printState();
+                printf(" %u %u %u %u\n", SIM_tick.evaluations, SIM_tick.reads,
+                        SIM_tick.actions, SIM_tick.gotos);
+            }
+            if (SIM_tick.clocks > maxClocks) {
+                maxClocks = SIM_tick.clocks;
+                maxReads = SIM_tick.reads;
+                maxTick = tick;
+            }
+            SIM_total.reads += SIM_tick.reads;
+            SIM_total.writes += SIM_tick.writes;
+            SIM_total.evaluations += SIM_tick.evaluations;
+            SIM_total.actions += SIM_tick.actions;
+            SIM_total.gotos += SIM_tick.gotos;
+            SIM_total.errors += SIM_tick.errors;
+            memset(&SIM_tick, 0, sizeof(SIM_tick));
+        }
+    }
+    fclose(trace);
+
+    unsigned long maxMicros = (unsigned long) maxClocks * 1000 / kHz;
+    printf("Image: %zu bytes, init reads: %u\n", size, initReads);
+    printf("Ticks: %u, evaluations: %u, reads: %u, writes: %u, actions: %u, gotos: %u, errors: %u\n",
+            tick, SIM_total.evaluations, SIM_total.reads, SIM_total.writes,
+            SIM_total.actions, SIM_total.gotos, SIM_total.errors);
+    printf("Slowest tick: %u (%u reads), ~%lu us at %lu kHz\n",
+            maxTick, maxReads, maxMicros, kHz);
+    printf("Suggested minimum SM_CHECK_INTERVAL: %lu ms\n", maxMicros / 1000 + 1);
+    return 0;
+}